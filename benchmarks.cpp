@@ -0,0 +1,256 @@
+// Microbenchmarks of the simulator's hot paths, built on Google Benchmark. The simulator is
+// compiled into this file, without its main(), so the benchmarks call its functions directly.
+// CMake builds them as the benchmarks target; by hand:
+//
+//   g++ -std=c++17 -O2 -pthread benchmarks.cpp -lbenchmark -o benchmarks
+//   ./benchmarks --benchmark_format=json > results.json
+
+#define SIMULATOR_NO_MAIN
+#include "final_code.cpp"
+
+#include <benchmark/benchmark.h> // for the benchmark registry, State and BENCHMARK_MAIN()
+#include <cstdio> // for remove()
+#include <fstream> // for ofstream (used for writing program files)
+
+/**
+ * Writes a program file for the benchmarks: a mix of every operation, ended by E.
+ * @param path the path of the file to write
+ * @param numInstructions the number of instructions before the final E
+ */
+void writeProgramFile(const string &path, int numInstructions) {
+    static const char *const lines[] = {"S 1000", "A 19", "D 53", "F 1", "A 55", "B", "R file_a"};
+    ofstream file(path.c_str());
+    for (int i = 0; i < numInstructions; ++i) {
+        file << lines[i % 7] << '\n';
+    }
+    file << "E\n";
+}
+
+/**
+ * Sets up a simulation whose init process runs the given program, without printing anything.
+ * @param policy the scheduling policy
+ * @param program the program of the init process
+ */
+void startBenchmarkSimulation(SimulationContext &context, SchedulerPolicy policy, ProgramPtr program) {
+    SimulatorOptions options;
+    options.scheduler = policy;
+    options.logLevel = LOG_OFF;
+    configureSimulation(context, options);
+    context.eventLog.start(LOG_OFF);
+
+    context.pcbTable.clear();
+    context.freePcbSlots.clear();
+    context.firstLivePcb = -1;
+    context.lastLivePcb = -1;
+    int initIndex = allocatePcb(context);
+    PcbEntry &init = context.pcbTable[initIndex];
+    init.processId = context.nextProcessId++;
+    init.parentProcessId = -1;
+    init.program = program;
+    init.state = STATE_RUNNING;
+    init.firstRunTime = 0;
+    context.runningState = initIndex;
+
+    context.scheduler = createScheduler(context, policy, context.agingInterval, context.randomSeed);
+    context.cpu.pProgram = program.get();
+    context.cpu.programCounter = 0;
+    context.cpu.value = 0;
+    context.cpu.timeSlice = context.scheduler->timeSliceFor(initIndex);
+    context.cpu.timeSliceUsed = 0;
+}
+
+/**
+ * Makes a program of count A instructions (a process that never blocks, forks or ends early).
+ */
+ProgramPtr makeArithmeticProgram(size_t count) {
+    Instruction add;
+    add.operation = 'A';
+    add.intArg = 1;
+    return make_shared<vector<Instruction>>(count, add);
+}
+
+/**
+ * Adds ready processes to the simulation, all running the init process's program, with the
+ * priorities spread over all levels.
+ * @param numProcesses the number of ready processes to add
+ */
+void addReadyProcesses(SimulationContext &context, int numProcesses) {
+    for (int i = 0; i < numProcesses; ++i) {
+        int index = allocatePcb(context);
+        PcbEntry &entry = context.pcbTable[index];
+        entry.processId = context.nextProcessId++;
+        entry.parentProcessId = 0;
+        entry.program = context.pcbTable[0].program;
+        entry.programCounter = i % entry.program->size();
+        entry.priority = i % NUM_PRIORITY_LEVELS;
+        entry.state = STATE_READY;
+        entry.firstRunTime = -1;
+        context.scheduler->enqueue(index);
+    }
+}
+
+// Parsing throughput of createProgram(), for programs of range(0) instructions.
+void BM_CreateProgram(benchmark::State &state) {
+    string path = "/tmp/simulator_benchmark_program_" + to_string(getpid());
+    writeProgramFile(path, state.range(0));
+    struct stat fileStat;
+    stat(path.c_str(), &fileStat);
+
+    SimulationContext context;
+    vector<Instruction> program;
+    for (auto _: state) {
+        if (!createProgram(context, path, program)) {
+            state.SkipWithError("createProgram() failed");
+            break;
+        }
+        benchmark::DoNotOptimize(program.data());
+    }
+    state.SetItemsProcessed(state.iterations() * (state.range(0) + 1));
+    state.SetBytesProcessed(state.iterations() * fileStat.st_size);
+    remove(path.c_str());
+}
+BENCHMARK(BM_CreateProgram)->Arg(100)->Arg(10000)->Arg(1000000)->Unit(benchmark::kMicrosecond);
+
+// Throughput of the newline marker newlineMarkers[range(0)] on a 64 KiB window of a program
+// file. Markers the CPU does not support are skipped.
+void BM_MarkNewlines(benchmark::State &state) {
+    const NewlineMarker &marker = newlineMarkers[state.range(0)];
+    state.SetLabel(marker.name);
+    if (&marker > newlineMarker) {
+        state.SkipWithError("not supported by this CPU");
+        return;
+    }
+
+    string text;
+    for (int i = 0; text.size() < 64 * 1024; ++i) {
+        text += i % 2 == 0 ? "S 1000\n" : "R file_a\n";
+    }
+    text.resize(64 * 1024);
+    vector<uint64_t> bitmap(text.size() / 64);
+    for (auto _: state) {
+        marker.mark(text.data(), text.size(), bitmap.data());
+        benchmark::DoNotOptimize(bitmap.data());
+    }
+    state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK(BM_MarkNewlines)->DenseRange(0, NUM_NEWLINE_MARKERS - 1);
+
+// Instructions per second of quantum(), with range(0) ready processes sharing the CPU
+// round-robin. Items are executed quanta.
+void BM_Quantum(benchmark::State &state) {
+    const unsigned int QUANTA_PER_ITERATION = 4096;
+    SimulationContext context;
+    startBenchmarkSimulation(context, POLICY_ROUND_ROBIN, makeArithmeticProgram(1 << 20));
+    addReadyProcesses(context, state.range(0));
+
+    for (auto _: state) {
+        quantum(context, QUANTA_PER_ITERATION);
+        // Rewind the running process long before it reaches the end of the program.
+        if ((size_t) context.cpu.programCounter > context.cpu.pProgram->size() / 2) {
+            context.cpu.programCounter = 0;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * QUANTA_PER_ITERATION);
+}
+BENCHMARK(BM_Quantum)->Arg(0)->Arg(10)->Arg(1000);
+
+// Latency of schedule() when the running process has used up its slice, under policy
+// range(0), with range(1) processes in the ready queue. Items are dispatches.
+void BM_Schedule(benchmark::State &state) {
+    SimulationContext context;
+    startBenchmarkSimulation(context, (SchedulerPolicy) state.range(0), makeArithmeticProgram(1024));
+    addReadyProcesses(context, state.range(1));
+
+    for (auto _: state) {
+        context.cpu.timeSliceUsed = context.cpu.timeSlice;
+        schedule(context);
+        benchmark::DoNotOptimize(context.runningState);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetLabel(schedulerNames[state.range(0)]);
+}
+BENCHMARK(BM_Schedule)
+    ->ArgsProduct({{POLICY_ROUND_ROBIN, POLICY_SRTF, POLICY_PRIORITY, POLICY_LOTTERY, POLICY_MLFQ},
+                   {10, 1000, 100000}});
+
+// Latency of schedule() under MLFQ when every call boosts the ready processes back to level 0:
+// time advances by the aging interval between calls. There are 10 ready processes and range(0)
+// blocked ones, which a boost should not have to visit. Items are boosts.
+void BM_ScheduleAging(benchmark::State &state) {
+    SimulationContext context;
+    startBenchmarkSimulation(context, POLICY_MLFQ, makeArithmeticProgram(1024));
+    addReadyProcesses(context, 10);
+    for (int i = 0; i < state.range(0); ++i) {
+        int index = allocatePcb(context);
+        PcbEntry &entry = context.pcbTable[index];
+        entry.processId = context.nextProcessId++;
+        entry.parentProcessId = 0;
+        entry.program = context.pcbTable[0].program;
+        entry.priority = i % NUM_PRIORITY_LEVELS;
+        entry.state = STATE_BLOCKED;
+        entry.firstRunTime = -1;
+        context.blockedState.push_back(index);
+    }
+
+    for (auto _: state) {
+        context.timestamp += context.agingInterval;
+        context.cpu.timeSliceUsed = context.cpu.timeSlice;
+        schedule(context);
+        benchmark::DoNotOptimize(context.runningState);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ScheduleAging)->Arg(0)->Arg(1000)->Arg(100000);
+
+// Cost of fork(): PCB allocation, initialization and the child's enqueue. The children are
+// ended in batches outside the timed region, so their slots are reused.
+void BM_Fork(benchmark::State &state) {
+    const int BATCH_SIZE = 65536;
+    SimulationContext context;
+    startBenchmarkSimulation(context, POLICY_ROUND_ROBIN, makeArithmeticProgram(1024));
+
+    int numForked = 0;
+    for (auto _: state) {
+        fork(context, 0);
+        if (++numForked == BATCH_SIZE) {
+            state.PauseTiming();
+            while (context.pcbTable.size() - context.freePcbSlots.size() > 1) {
+                releasePcb(context, context.lastLivePcb);
+            }
+            context.scheduler = createScheduler(context, POLICY_ROUND_ROBIN, context.agingInterval,
+                                                context.randomSeed);
+            numForked = 0;
+            state.ResumeTiming();
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Fork);
+
+// Cost of the P command in format range(0) with range(1) live processes, written to
+// /dev/null. Items are dumped processes.
+void BM_Print(benchmark::State &state) {
+    SimulationContext context;
+    startBenchmarkSimulation(context, POLICY_ROUND_ROBIN, makeArithmeticProgram(1024));
+    addReadyProcesses(context, state.range(1) - 1);
+    ostream discardedOutput(NULL);
+    context.output = &discardedOutput;
+
+    StateWriter writer;
+    writer.open("/dev/null");
+    context.stateWriter = &writer;
+    context.printFormat = (PrintFormat) state.range(0);
+
+    static const char *const formatNames[] = {"text", "jsonl", "csv", "binary"};
+    for (auto _: state) {
+        printState(context);
+        writer.flush();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(1));
+    state.SetLabel(formatNames[state.range(0)]);
+}
+BENCHMARK(BM_Print)
+    ->ArgsProduct({{PRINT_TEXT, PRINT_JSONL, PRINT_CSV, PRINT_BINARY}, {100, 10000}})
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
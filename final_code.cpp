@@ -1,36 +1,115 @@
-#include <boost/algorithm/string.hpp> // for trimming the name of the file
+#include <algorithm> // for push_heap() and pop_heap() (used by the heap based schedulers)
+#include <atomic> // for atomic (used to hand out SMP ticks to host threads)
+#include <cassert> // for assert()
 #include <cctype> // for toupper()
+#include <climits> // for UINT_MAX (used for checking repeat counts)
+#include <condition_variable> // for condition_variable (used by the event log's writer thread)
+#include <cstdint> // for int32_t (used for instruction operands)
 #include <cstdlib> // for EXIT_SUCCESS and EXIT_FAILURE
 #include <cstring> // for strerror()
 #include <cerrno> // for errno
+#include <charconv> // for to_chars() and from_chars() (used for state dumps and program files)
+#include <chrono> // for steady_clock (used for timing headless runs)
+#include <cmath> // for ceil() (used for histogram percentiles)
 #include <deque> // for deque (used for ready and blocked queues)
-#include <fstream> // for ifstream (used for reading simulated programs)
+#include <fcntl.h> // for open() (used for reading command scripts)
+#include <iomanip> // for setw() (used for the sweep table)
 #include <iostream> // for cout, endl, and cin
-#include <sstream> // for stringstream (used for parsing simulated programs)
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // for the SSE4.2 and AVX2 intrinsics (used for splitting program files)
+#define SIMULATOR_X86_SIMD
+#endif
+#include <linux/futex.h> // for FUTEX_WAIT and FUTEX_WAKE (used to park idle threads and processes)
+#include <memory> // for shared_ptr (used for sharing decoded programs)
+#include <mutex> // for mutex (used for the shared tables and the event log)
+#include <random> // for mt19937 (used by the lottery scheduler)
+#include <shared_mutex> // for shared_mutex (used for the shared tables, which are read-mostly)
+#include <sstream> // for stringstream (used for parsing option lists)
+#include <sys/mman.h> // for shm_open() and mmap() (used for shared memory and program files)
+#include <sys/stat.h> // for stat() (used for validating cached programs)
+#include <sys/syscall.h> // for SYS_futex (used to park idle threads and processes)
 #include <sys/wait.h> // for wait()
+#include <thread> // for thread (used to run simulated CPUs on host threads)
 #include <unistd.h> // for pipe(), read(), write(), close(), fork(), and _exit()
+#include <string_view> // for string_view (used for interning filenames)
+#include <unordered_map> // for unordered_map (used for the program cache)
 #include <vector> // for vector (used for PCB table)
 
 using namespace std;
-using namespace boost::algorithm; // by this cmd to install boost libraries: sudo apt install libboost-all-dev
-                                  // for using boost/algorithm/string.hpp header file
-
-#define NUM_OF_PROCESSES 10
 
+// An instruction is packed into 8 bytes: a one-byte operation and a 32-bit operand. For the
+// R operation the operand is the index of the filename in the string table.
 class Instruction {
 public:
     char operation;
-    int intArg;
-    string stringArg;
+    int32_t intArg;
+};
+
+static_assert(sizeof(Instruction) == 8, "Instruction must stay packed into 8 bytes");
+
+// Interns strings (the filenames of R operations), so each distinct filename is stored once
+// and instructions refer to it by index. The table is shared by all simulations of the
+// process, so it is guarded by a shared mutex: lookups, by far the most common, only share it.
+class StringTable {
+public:
+    /**
+     * Gets the index of a string, adding it to the table if it is new.
+     * @param value the string to intern
+     */
+    int32_t intern(string_view value) {
+        {
+            shared_lock<shared_mutex> lock(tableMutex);
+            unordered_map<string_view, int32_t>::iterator found = indices.find(value);
+            if (found != indices.end()) {
+                return found->second;
+            }
+        }
+
+        unique_lock<shared_mutex> lock(tableMutex);
+        unordered_map<string_view, int32_t>::iterator found = indices.find(value);
+        if (found != indices.end()) {
+            return found->second;
+        }
+        int32_t index = strings.size();
+        strings.emplace_back(value);
+        indices.emplace(strings.back(), index);
+        return index;
+    }
+
+    // The returned reference stays valid while new strings are interned (strings is a deque).
+    const string &lookup(int32_t index) const {
+        shared_lock<shared_mutex> lock(tableMutex);
+        return strings[index];
+    }
+
+    size_t size() const {
+        shared_lock<shared_mutex> lock(tableMutex);
+        return strings.size();
+    }
+
+private:
+    mutable shared_mutex tableMutex;
+    deque<string> strings;
+    // Keyed by views of the strings, so looking up a string does not copy it.
+    unordered_map<string_view, int32_t> indices;
 };
 
+StringTable internedStrings;
+
+// A decoded program is never modified once loaded, so PCBs share it through this reference-
+// counted pointer. This makes program images copy-on-write: F shares the parent's image with
+// the child in O(1), and the only write, R, swaps in a different image instead of changing
+// the shared one. An image is freed when the last PCB referring to it ends or replaces it.
+typedef shared_ptr<const vector<Instruction>> ProgramPtr;
+
 class Cpu {
 public:
-    vector<Instruction> *pProgram;
+    const vector<Instruction> *pProgram;
     int programCounter;
     int value;
-    int timeSlice;
-    int timeSliceUsed;
+    // Quanta the process may run (unsigned, like Scheduler::timeSliceFor()) and has run.
+    unsigned int timeSlice;
+    unsigned int timeSliceUsed;
 };
 
 enum State {
@@ -43,535 +122,4861 @@ class PcbEntry {
 public:
     int processId;
     int parentProcessId;
-    vector<Instruction> program;
+    ProgramPtr program;
     unsigned int programCounter;
     int value;
     unsigned int priority;
     State state;
     unsigned int startTime;
     unsigned int timeUsed;
+    // The simulated time the process entered its current state.
+    unsigned int stateTime;
+    // Scheduling metrics of the process: its total time spent ready and blocked, the time it
+    // first ran (-1 until then) and the number of times it was given a CPU.
+    unsigned int waitingTime;
+    unsigned int blockedTime;
+    int firstRunTime;
+    unsigned int numContextSwitches;
+    // The simulated CPU the process last ran on (always 0 unless in SMP mode).
+    int lastCpu;
+    // Links of the list of live processes, in creation order (-1 at the ends).
+    int previousLive;
+    int nextLive;
 };
 
 //string trim(string trimmed_str);
 
-// The table has PCBs for all current processes in the computer system:
-//vector<PcbEntry*> processesTable;
-PcbEntry pcbEntry[NUM_OF_PROCESSES];
-unsigned int timestamp = 0;
-Cpu cpu;
-
-// For the states below, -1 indicates empty (since it is an invalid index).
-int runningState = -1;
-deque<int> readyState;
-deque<int> blockedState;
-
-// In this implementation, we'll never explicitly clear PCB entries and the index in
-// the table will always be the process ID. These choices waste memory, but since this
-// program is just a simulation it the easiest approach. Additionally, debugging is
-// simpler since table slots and process IDs are never re-used.
-double cumulativeTimeDiff = 0;
-int numTerminatedProcesses = 0;
-
-bool createProgram(const string &filename, vector<Instruction> &program) {
-    ifstream file;
-    int lineNum = 0;
+class Scheduler;
+class CpuThreadPool;
+class StateWriter;
 
-    program.clear();
-    file.open(filename.c_str());
+// Scheduling policies, selected with --scheduler.
+enum SchedulerPolicy {
+    POLICY_FCFS,
+    POLICY_SJF,
+    POLICY_SRTF,
+    POLICY_ROUND_ROBIN,
+    POLICY_PRIORITY,
+    POLICY_LOTTERY,
+    POLICY_MLFQ,
+    NUM_SCHEDULER_POLICIES
+};
 
-    if (!file.is_open()) {
-        char* currDir = getcwd(NULL, 0);
-        cout << "Error opening file " << filename << "\" in \"" << currDir << "\"" << endl;
-        free(currDir);
-        return false;
+// Names of the scheduling policies on the command line, in SchedulerPolicy order.
+const char *const schedulerNames[NUM_SCHEDULER_POLICIES] = {
+    "fcfs", "sjf", "srtf", "rr", "priority", "lottery", "mlfq"
+};
+
+// A simulated CPU of the SMP mode: its registers, the process it runs and its local ready
+// queue. The execute phase of a tick also leaves the fetched instruction here.
+class CpuContext {
+public:
+    Cpu cpu;
+    int runningState = -1;
+    unique_ptr<Scheduler> scheduler;
+    bool ranProcess = false;
+    char operation = 0;
+    int32_t operand = 0;
+};
+
+// Counters reported at the end of a headless run.
+class RunStatistics {
+public:
+    unsigned long long numCommands;
+    unsigned long long numQuanta;
+    unsigned long long numCreatedProcesses;
+    unsigned long long numContextSwitches;
+    unsigned long long numSteals;
+};
+
+/**
+ * A histogram of simulated times in the style of an HDR histogram: values below 64 have a
+ * bucket each, and every larger power of two is split into 32 linear buckets, so any 32-bit
+ * value is kept within about 3% in a fixed number of buckets. Recording is O(1).
+ */
+class LatencyHistogram {
+public:
+    static const unsigned int SUB_BUCKET_BITS = 5;
+    static const unsigned int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const unsigned int NUM_BUCKETS = (32 - SUB_BUCKET_BITS) * SUB_BUCKETS + SUB_BUCKETS;
+
+    uint64_t counts[NUM_BUCKETS];
+    uint64_t numValues;
+    uint32_t maxValue;
+
+    void record(uint32_t value) {
+        ++counts[bucketOf(value)];
+        ++numValues;
+        maxValue = max(maxValue, value);
     }
 
-    while (file.good()) {
-        string line;
-        getline(file, line);
+    /**
+     * Gets a percentile of the recorded values.
+     * @param percent the percentile, between 0 and 100
+     * @return the highest value that falls in the same bucket as the percentile (at most the
+     *         maximum recorded value), or 0 if nothing was recorded
+     */
+    uint32_t percentile(double percent) const {
+        uint64_t rank = (uint64_t) ceil(percent / 100 * numValues);
+        uint64_t seen = 0;
+        for (unsigned int i = 0; i < NUM_BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= max(rank, (uint64_t) 1)) {
+                return (uint32_t) min((uint64_t) maxValue, highestValueOf(i));
+            }
+        }
+        return 0;
+    }
 
-        trim(line);
+private:
+    static unsigned int bucketOf(uint32_t value) {
+        if (value < 2 * SUB_BUCKETS) {
+            return value;
+        }
+        unsigned int shift = 31 - __builtin_clz(value) - SUB_BUCKET_BITS;
+        return shift * SUB_BUCKETS + (value >> shift);
+    }
 
-        if (line.size() > 0) {
-            Instruction instruction;
-            instruction.operation = toupper(line[0]);
-            //instruction.stringArg = trim(line.erase(0, 1));
-            line.erase(0,1);
-            trim(line);
-	        instruction.stringArg = line;
-            
-            stringstream argStream(instruction.stringArg);
-            switch (instruction.operation) {
-                case 'S': // Integer argument.
-                case 'A': // Integer argument.
-                case 'D': // Integer argument.
-                case 'F': // Integer argument.
-                    if (!(argStream >> instruction.intArg)) {
-                        cout << filename << ":" << lineNum
-                             << " - Invalid integer argument "
-                             << instruction.stringArg << " for "
-                             << instruction.operation << " operation"
-                             << endl;
-                        file.close();
-                        return false;
-                    }
-                    break;
-                case 'B': // No argument.
-                case 'E': // No argument.
-                    break;
-                case 'R': // String argument.
-                    // Note that since the string is trimmed on both ends, filenames
-                    // with leading or trailing whitespace (unlikely) will not work.
-                    if (instruction.stringArg.size() == 0) {
-                        cout << filename << ":" << lineNum << " -Missing string argument"
-                             << endl;
-                        file.close();
-                        return false;
-                    }
-                    break;
-                default:
-                    cout << filename << ":" << lineNum << " - Invalid operation, "
-                         << instruction.operation << endl;
-                    file.close();
-                    return false;
+    static uint64_t highestValueOf(unsigned int bucket) {
+        if (bucket < 2 * SUB_BUCKETS) {
+            return bucket;
+        }
+        unsigned int shift = bucket / SUB_BUCKETS - 1;
+        uint64_t top = bucket - shift * SUB_BUCKETS;
+        return ((top + 1) << shift) - 1;
+    }
+};
+
+// Scheduling metrics of a run. They are updated on every state transition of a process, so
+// reporting them never needs a pass over the processes.
+class SchedulingMetrics {
+public:
+    // Totals over the terminated processes.
+    double totalWaitingTime;
+    double totalBlockedTime;
+    // Total over the processes that have run at least once.
+    double totalResponseTime;
+    // Quanta in which a simulated CPU had no process to run.
+    unsigned long long numIdleQuanta;
+    LatencyHistogram turnaroundTimes;
+    LatencyHistogram waitingTimes;
+    LatencyHistogram responseTimes;
+};
+
+// Formats of the P command, selected with --print-format.
+enum PrintFormat {
+    PRINT_TEXT,
+    PRINT_JSONL,
+    PRINT_CSV,
+    PRINT_BINARY
+};
+
+// How much the process manager reports about the simulation (set with --log-level).
+enum LogLevel {
+    LOG_OFF,
+    LOG_NORMAL,
+    // Also prefixes every line with the simulated time.
+    LOG_VERBOSE
+};
+
+// The events of the simulation that are reported through the event log.
+enum EventType : uint8_t {
+    EVENT_QUANTUM,
+    EVENT_IDLE,
+    EVENT_END_OF_PROGRAM,
+    EVENT_SET,
+    EVENT_ADD,
+    EVENT_DECREMENT,
+    EVENT_RUN,
+    EVENT_PREEMPT,
+    EVENT_STEAL,
+    EVENT_BLOCK,
+    EVENT_UNBLOCK,
+    EVENT_END,
+    EVENT_FORK,
+    EVENT_REPLACE,
+    EVENT_REPLACE_FAILED
+};
+
+// A fixed-size event record. What the arguments mean depends on the type of the event.
+class LogEvent {
+public:
+    EventType type;
+    int32_t cpu;
+    uint32_t time;
+    int32_t arg;
+    int32_t arg2;
+    // An interned string (the filename of an R operation), which never moves or changes.
+    const string *text;
+};
+
+/**
+ * Sees every command the process manager consumes and every event of the simulation, in
+ * order. Used to record and to verify traces.
+ */
+class TraceObserver {
+public:
+    virtual ~TraceObserver() {}
+    virtual void onCommand(char command, unsigned int count) = 0;
+    virtual void onEvent(const LogEvent &event) = 0;
+    // Called when the process manager terminates.
+    virtual void finish() = 0;
+};
+
+/**
+ * Asynchronous event log. The simulation only copies fixed-size records into a ring, and a
+ * background writer thread turns them into text and writes them to stdout in large chunks.
+ * All events come from the thread running the process manager (in SMP mode they are
+ * reported in the commit phase), so the ring has a single producer and a single consumer.
+ *
+ * Other output of the process manager is written directly, so flush() has to be called before
+ * writing it and the output stream has to be flushed before the next event is recorded.
+ */
+class EventLog {
+public:
+    ~EventLog() {
+        stop();
+    }
+
+    /**
+     * Starts the writer thread.
+     * @param logLevel the level of detail, LOG_OFF records nothing
+     */
+    void start(LogLevel logLevel) {
+        stop();
+        level = logLevel;
+        head.store(0);
+        tail.store(0);
+        written.store(0);
+        stopping = false;
+        if (level != LOG_OFF) {
+            if (!ring) {
+                ring.reset(new LogEvent[CAPACITY]);
             }
-            
-            program.push_back(instruction);
+            writer = thread(&EventLog::writeEvents, this);
+        }
+    }
+
+    // Writes out the remaining events and stops the writer thread.
+    void stop() {
+        if (!writer.joinable()) {
+            return;
+        }
+        {
+            lock_guard<mutex> lock(writerMutex);
+            stopping = true;
+        }
+        writerCondition.notify_one();
+        writer.join();
+        level = LOG_OFF;
+    }
+
+    // Records an event.
+    void record(const LogEvent &event) {
+        if (level == LOG_OFF) {
+            return;
+        }
+
+        uint64_t position = head.load(memory_order_relaxed);
+        while (position - tail.load(memory_order_acquire) == CAPACITY) {
+            wakeWriter();
+            this_thread::yield();
+        }
+
+        ring[position & (CAPACITY - 1)] = event;
+        head.store(position + 1, memory_order_release);
+    }
+
+    // Hands the recorded events to the writer thread without waiting for them to be written.
+    void publish() {
+        if (head.load(memory_order_relaxed) != tail.load(memory_order_acquire)) {
+            wakeWriter();
+        }
+    }
+
+    // Waits until every recorded event has been written to stdout.
+    void flush() {
+        if (!writer.joinable()) {
+            return;
+        }
+        uint64_t target = head.load(memory_order_relaxed);
+        if (written.load(memory_order_acquire) == target) {
+            return;
+        }
+        wakeWriter();
+        unique_lock<mutex> lock(writerMutex);
+        writtenCondition.wait(lock, [&] { return written.load() >= target; });
+    }
+
+private:
+    static const uint64_t CAPACITY = 1 << 14;
+    // The writer writes to stdout once this much text has been formatted.
+    static const size_t WRITE_SIZE = 64 * 1024;
+
+    void wakeWriter() {
+        // Pairs with the writer announcing that it sleeps and then checking head.
+        atomic_thread_fence(memory_order_seq_cst);
+        if (writerSleeping.exchange(false)) {
+            lock_guard<mutex> lock(writerMutex);
+            writerCondition.notify_one();
+        }
+    }
+
+    // Body of the writer thread.
+    void writeEvents() {
+        string text;
+        bool atLineStart = true;
+        for (;;) {
+            uint64_t position = tail.load(memory_order_relaxed);
+            uint64_t end = head.load(memory_order_acquire);
+            while (position != end && text.size() < WRITE_SIZE) {
+                formatEvent(ring[position & (CAPACITY - 1)], text, atLineStart);
+                tail.store(++position, memory_order_release);
+            }
+
+            if (position != end) {
+                writeText(text);
+                continue;
+            }
+
+            // Caught up: write the text out and sleep until more events arrive.
+            writeText(text);
+            unique_lock<mutex> lock(writerMutex);
+            written.store(position);
+            writtenCondition.notify_all();
+            writerSleeping.store(true);
+            writerCondition.wait(lock, [&] {
+                return stopping || !writerSleeping.load() || head.load() != position;
+            });
+            writerSleeping.store(false);
+            if (stopping && head.load() == position) {
+                return;
+            }
+        }
+    }
+
+    static void writeText(string &text) {
+        const char *data = text.data();
+        size_t remaining = text.size();
+        while (remaining > 0) {
+            ssize_t numWritten = write(STDOUT_FILENO, data, remaining);
+            if (numWritten == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            data += numWritten;
+            remaining -= numWritten;
+        }
+        text.clear();
+    }
+
+    // Appends the text of an event, which is the same as the simulator printed directly.
+    void formatEvent(const LogEvent &event, string &text, bool &atLineStart) const {
+        if (level == LOG_VERBOSE && atLineStart) {
+            text += "[" + to_string(event.time) + "] ";
+        }
+        atLineStart = true;
+
+        switch (event.type) {
+            case EVENT_QUANTUM:
+                if (event.arg != -1) {
+                    text += "CPU " + to_string(event.arg) + ": ";
+                }
+                text += "In quantum ";
+                atLineStart = false;
+                return;
+            case EVENT_IDLE:
+                text += "No processes are running";
+                break;
+            case EVENT_END_OF_PROGRAM:
+                text += "End of program reached without E operation";
+                break;
+            case EVENT_SET:
+                text += "Set CPU's value to " + to_string(event.arg) + "\n";
+                text += "instruction S " + to_string(event.arg);
+                break;
+            case EVENT_ADD:
+                text += "Incremented CPU's value by " + to_string(event.arg) + "\n";
+                text += "instruction A " + to_string(event.arg);
+                break;
+            case EVENT_DECREMENT:
+                text += "Decremented CPU's value by " + to_string(event.arg);
+                break;
+            case EVENT_RUN:
+                text += "Process running, pid = " + to_string(event.arg);
+                break;
+            case EVENT_PREEMPT:
+                text += "Preempted process, pid = " + to_string(event.arg);
+                break;
+            case EVENT_STEAL:
+                text += "CPU " + to_string(event.cpu) + " stole process from CPU "
+                        + to_string(event.arg) + ", pid = " + to_string(event.arg2);
+                break;
+            case EVENT_BLOCK:
+                text += "Blocked process, pid = " + to_string(event.arg);
+                break;
+            case EVENT_UNBLOCK:
+                text += "Unblocked process, pid = " + to_string(event.arg);
+                break;
+            case EVENT_END:
+                text += "Ended process, pid = " + to_string(event.arg);
+                break;
+            case EVENT_FORK:
+                text += "Forked new process, pid = " + to_string(event.arg);
+                break;
+            case EVENT_REPLACE:
+                text += "Replaced process with " + *event.text + ", pid = " + to_string(event.arg);
+                break;
+            case EVENT_REPLACE_FAILED:
+                text += "Error occurred when executing R operation, end the process now!";
+                break;
+        }
+        text += '\n';
+    }
+
+    LogLevel level = LOG_OFF;
+    // Allocated when the log is first started, as most simulations of a sweep log nothing.
+    unique_ptr<LogEvent[]> ring;
+    // Number of events recorded, taken by the writer and written to stdout.
+    alignas(64) atomic<uint64_t> head{0};
+    alignas(64) atomic<uint64_t> tail{0};
+    alignas(64) atomic<uint64_t> written{0};
+    atomic<bool> writerSleeping{false};
+    bool stopping = false;
+    mutex writerMutex;
+    condition_variable writerCondition;
+    condition_variable writtenCondition;
+    thread writer;
+};
+
+/**
+ * The whole state of one simulation. The operations of the simulator work on the context they
+ * are given, so one process can host many independent simulations, each on its own thread.
+ * Only the program cache and the string table are shared between the simulations.
+ */
+class SimulationContext {
+public:
+    SimulationContext() = default;
+    ~SimulationContext();
+
+    // The table has PCBs for all current processes in the computer system. It is a deque so
+    // that growing it never moves the existing entries.
+    deque<PcbEntry> pcbTable;
+    // Indices of reclaimed PCB slots, used as a stack so allocating and releasing a PCB is O(1).
+    // Slots of ended processes are re-used by later forks, so the slot index is internal.
+    vector<int> freePcbSlots;
+    // Ends of the list of live processes, threaded through their PCB entries.
+    int firstLivePcb = -1;
+    int lastLivePcb = -1;
+    // The process ID of the next process created. Processes are reported by their process IDs,
+    // which are never re-used, unlike PCB slots.
+    int nextProcessId = 0;
+    unsigned int timestamp = 0;
+    Cpu cpu = Cpu();
+
+    // For the states below, -1 indicates empty (since it is an invalid index).
+    int runningState = -1;
+    deque<int> blockedState;
+
+    double cumulativeTimeDiff = 0;
+    SchedulingMetrics metrics = SchedulingMetrics();
+    int numTerminatedProcesses = 0;
+
+    // Number of quanta a process may run before it is preempted (set with --time-slice).
+    // Under MLFQ this is the slice of the highest priority level.
+    unsigned int timeSliceLength = 5;
+
+    // The scheduler in use, created when the process manager starts.
+    unique_ptr<Scheduler> scheduler;
+    SchedulerPolicy schedulerPolicy = POLICY_ROUND_ROBIN;
+    unsigned int agingInterval = 100;
+    unsigned int randomSeed = 1;
+
+    // Number of simulated CPUs (set with --cpus). With more than one the simulator runs in SMP
+    // mode, where every Q command is one tick of all CPUs.
+    unsigned int numCpus = 1;
+    // Number of host threads that run the CPUs of an SMP tick (set with --cpu-threads).
+    unsigned int numCpuThreads = 1;
+
+    // The CPUs of the SMP mode (empty on a uniprocessor). The operations work on cpu,
+    // runningState and scheduler, so the CPU being worked on is bound by swapping its
+    // context into them and unbound by swapping it back out.
+    vector<CpuContext> cpus;
+    int boundCpu = -1;
+    // The host threads of the SMP mode, if numCpuThreads is more than 1.
+    unique_ptr<CpuThreadPool> cpuThreadPool;
+
+    RunStatistics runStats = RunStatistics();
+    // Where the process manager prints its replies and the P command prints the state.
+    ostream *output = &cout;
+    // Format of the P command (set with --print-format), and the writer that takes its
+    // output instead of output (set up for --print-output or a machine-readable format).
+    PrintFormat printFormat = PRINT_TEXT;
+    StateWriter *stateWriter = NULL;
+    EventLog eventLog;
+    LogLevel logLevel = LOG_NORMAL;
+    // The observer of the run (set with --record and --replay), NULL if none.
+    TraceObserver *traceObserver = NULL;
+
+    // Checkpoint image written when the process manager terminates (set with --checkpoint),
+    // and every checkpointInterval commands if that is not 0. The run starts from the image
+    // in restorePath instead of the init process if that is set (with --restore).
+    string checkpointPath;
+    unsigned int checkpointInterval = 0;
+    string restorePath;
+
+    // Whether loadProgram() trusts programs that are already cached instead of checking their
+    // files again. Sweeps set it: their simulations start with an empty cache, so every
+    // program is checked once, when the first simulation loads it, and then shared read-only.
+    bool reuseCachedPrograms = false;
+};
+
+/**
+ * Reports an event of the simulation to the trace observer and the event log.
+ */
+inline void logEvent(SimulationContext &context, EventType type, int32_t arg = 0,
+                     int32_t arg2 = 0, const string *text = NULL) {
+    LogEvent event = {type, context.boundCpu, context.timestamp, arg, arg2, text};
+    if (context.traceObserver != NULL) {
+        context.traceObserver->onEvent(event);
+    }
+    context.eventLog.record(event);
+}
+
+// Number of priority levels used by the priority based schedulers. Level 0 is the highest.
+#define NUM_PRIORITY_LEVELS 8
+
+/**
+ * Interface of a scheduling policy. A policy owns the ready processes (by PCB index) and
+ * decides which one runs next and when the running process has to give up the CPU.
+ */
+class Scheduler {
+public:
+    explicit Scheduler(SimulationContext &context) : context(context) {}
+    virtual ~Scheduler() {}
+
+    // Adds a process that became ready (new, preempted or unblocked).
+    virtual void enqueue(int process) = 0;
+
+    // Removes and returns the next process to run, or -1 if no process is ready.
+    virtual int pickNext() = 0;
+
+    // Called when the running process blocks.
+    virtual void onBlock(int process) {}
+
+    // Called when a blocked process is unblocked, before it is enqueued.
+    virtual void onUnblock(int process) {}
+
+    // Called on every scheduling tick.
+    virtual void onTick() {}
+
+    /**
+     * Decides whether the running process gives up the CPU to a ready process.
+     * @param running the PCB index of the running process
+     * @param sliceExpired whether the running process has used up its time slice
+     */
+    virtual bool shouldPreempt(int running, bool sliceExpired) = 0;
+
+    // Gets the length of the time slice a process is given when it is dispatched.
+    virtual unsigned int timeSliceFor(int process) const {
+        return context.timeSliceLength;
+    }
+
+    // Lists the ready processes in the order they would run (for the P command).
+    virtual void listReady(vector<int> &processes) const = 0;
+
+    // Gets the number of ready processes.
+    virtual size_t numReady() const = 0;
+
+    // Gets the state of the policy that its ready processes do not imply (for checkpoints).
+    virtual string saveState() const {
+        return string();
+    }
+
+    // Restores the state from saveState(), once the ready processes are enqueued again.
+    virtual void restoreState(const string &state) {}
+
+protected:
+    // The simulation whose processes are scheduled.
+    SimulationContext &context;
+};
+
+// Time slice of the non-preemptive policies: a process keeps the CPU until it blocks or ends.
+const unsigned int UNLIMITED_TIME_SLICE = ~0u;
+
+/**
+ * Gets the number of instructions a process has left, which is the job length used by the
+ * shortest-job policies.
+ * @param process the PCB index of the process
+ */
+unsigned int remainingInstructions(const SimulationContext &context, int process) {
+    const PcbEntry &entry = context.pcbTable[process];
+    size_t programCounter = process == context.runningState ? context.cpu.programCounter : entry.programCounter;
+    return entry.program->size() > programCounter ? entry.program->size() - programCounter : 0;
+}
+
+// First-come, first-served: one FIFO and no preemption.
+class FcfsScheduler : public Scheduler {
+public:
+    using Scheduler::Scheduler;
+
+    void enqueue(int process) override {
+        readyQueue.push_back(process);
+    }
+
+    int pickNext() override {
+        if (readyQueue.empty()) {
+            return -1;
+        }
+        int process = readyQueue.front();
+        readyQueue.pop_front();
+        return process;
+    }
+
+    bool shouldPreempt(int running, bool sliceExpired) override {
+        return false;
+    }
+
+    unsigned int timeSliceFor(int process) const override {
+        return UNLIMITED_TIME_SLICE;
+    }
+
+    void listReady(vector<int> &processes) const override {
+        processes.assign(readyQueue.begin(), readyQueue.end());
+    }
+
+    size_t numReady() const override {
+        return readyQueue.size();
+    }
+
+protected:
+    deque<int> readyQueue;
+};
+
+// Round-robin: FCFS order, but the running process is preempted when its slice expires.
+class RoundRobinScheduler : public FcfsScheduler {
+public:
+    using FcfsScheduler::FcfsScheduler;
+
+    bool shouldPreempt(int running, bool sliceExpired) override {
+        return sliceExpired && !readyQueue.empty();
+    }
+
+    unsigned int timeSliceFor(int process) const override {
+        return context.timeSliceLength;
+    }
+};
+
+/**
+ * Base of the policies that always run the ready process with the smallest key. The ready
+ * processes are kept in a binary min-heap, so enqueue and pick are O(log n). Processes with
+ * equal keys run in the order they became ready.
+ */
+class HeapScheduler : public Scheduler {
+public:
+    explicit HeapScheduler(SimulationContext &context) : Scheduler(context), nextSequence(0) {}
+
+    void enqueue(int process) override {
+        HeapEntry entry = {key(process), nextSequence++, process};
+        readyHeap.push_back(entry);
+        push_heap(readyHeap.begin(), readyHeap.end(), greater<HeapEntry>());
+    }
+
+    int pickNext() override {
+        if (readyHeap.empty()) {
+            return -1;
+        }
+        pop_heap(readyHeap.begin(), readyHeap.end(), greater<HeapEntry>());
+        int process = readyHeap.back().process;
+        readyHeap.pop_back();
+        return process;
+    }
+
+    void listReady(vector<int> &processes) const override {
+        vector<HeapEntry> sorted(readyHeap);
+        sort(sorted.begin(), sorted.end());
+        processes.clear();
+        for (const HeapEntry &entry: sorted) {
+            processes.push_back(entry.process);
+        }
+    }
+
+    size_t numReady() const override {
+        return readyHeap.size();
+    }
+
+protected:
+    // Gets the key a process is ordered by when it is enqueued. Smaller keys run first.
+    virtual unsigned int key(int process) const = 0;
+
+    // Gets the smallest key of the ready processes. The heap must not be empty.
+    unsigned int smallestKey() const {
+        return readyHeap.front().key;
+    }
+
+    class HeapEntry {
+    public:
+        unsigned int key;
+        unsigned long long sequence;
+        int process;
+
+        bool operator<(const HeapEntry &other) const {
+            return key != other.key ? key < other.key : sequence < other.sequence;
+        }
+
+        bool operator>(const HeapEntry &other) const {
+            return other < *this;
+        }
+    };
+
+    vector<HeapEntry> readyHeap;
+    unsigned long long nextSequence;
+};
+
+// Shortest job first: the process with the fewest remaining instructions runs next, without
+// preemption.
+class SjfScheduler : public HeapScheduler {
+public:
+    using HeapScheduler::HeapScheduler;
+
+    bool shouldPreempt(int running, bool sliceExpired) override {
+        return false;
+    }
+
+    unsigned int timeSliceFor(int process) const override {
+        return UNLIMITED_TIME_SLICE;
+    }
+
+protected:
+    unsigned int key(int process) const override {
+        return remainingInstructions(context, process);
+    }
+};
+
+// Shortest remaining time first: like SJF, but a ready process with fewer remaining
+// instructions preempts the running process.
+class SrtfScheduler : public SjfScheduler {
+public:
+    using SjfScheduler::SjfScheduler;
+
+    bool shouldPreempt(int running, bool sliceExpired) override {
+        return !readyHeap.empty() && smallestKey() < remainingInstructions(context, running);
+    }
+};
+
+// Preemptive priority scheduling on PcbEntry::priority (0 is the highest), with round-robin
+// between processes of the same priority.
+class PriorityScheduler : public HeapScheduler {
+public:
+    using HeapScheduler::HeapScheduler;
+
+    bool shouldPreempt(int running, bool sliceExpired) override {
+        if (readyHeap.empty()) {
+            return false;
+        }
+        unsigned int runningPriority = context.pcbTable[running].priority;
+        return smallestKey() < runningPriority || (sliceExpired && smallestKey() == runningPriority);
+    }
+
+protected:
+    unsigned int key(int process) const override {
+        return context.pcbTable[process].priority;
+    }
+};
+
+/**
+ * Lottery scheduling: every slice, a ticket is drawn at random among the ready processes and
+ * its owner runs. Higher priority processes hold more tickets. The tickets are kept in a
+ * Fenwick tree indexed by PCB index, so adding, removing and drawing a ticket are O(log n).
+ */
+class LotteryScheduler : public Scheduler {
+public:
+    LotteryScheduler(SimulationContext &context, unsigned int seed)
+        : Scheduler(context), tree(1, 0), totalTickets(0), numReadyProcesses(0), random(seed) {}
+
+    void enqueue(int process) override {
+        if ((size_t) process >= tickets.size()) {
+            grow(process + 1);
+        }
+        unsigned int priority = context.pcbTable[process].priority;
+        tickets[process] = priority < NUM_PRIORITY_LEVELS ? NUM_PRIORITY_LEVELS - priority : 1;
+        update(process, tickets[process]);
+        numReadyProcesses++;
+    }
+
+    int pickNext() override {
+        if (totalTickets == 0) {
+            return -1;
+        }
+        unsigned long long ticket = uniform_int_distribution<unsigned long long>(0, totalTickets - 1)(random);
+        int process = findOwner(ticket);
+        update(process, -(long long) tickets[process]);
+        tickets[process] = 0;
+        numReadyProcesses--;
+        return process;
+    }
+
+    bool shouldPreempt(int running, bool sliceExpired) override {
+        return sliceExpired && totalTickets > 0;
+    }
+
+    void listReady(vector<int> &processes) const override {
+        processes.clear();
+        for (size_t process = 0; process < tickets.size(); ++process) {
+            if (tickets[process] > 0) {
+                processes.push_back(process);
+            }
+        }
+    }
+
+    size_t numReady() const override {
+        return numReadyProcesses;
+    }
+
+    string saveState() const override {
+        ostringstream state;
+        state << random;
+        return state.str();
+    }
+
+    void restoreState(const string &state) override {
+        istringstream(state) >> random;
+    }
+
+private:
+    // Adds delta tickets to a process.
+    void update(int process, long long delta) {
+        totalTickets += delta;
+        for (size_t i = process + 1; i < tree.size(); i += i & (~i + 1)) {
+            tree[i] += delta;
+        }
+    }
+
+    // Gets the process holding the given ticket, i.e. the smallest index whose prefix sum of
+    // tickets is greater than ticket.
+    int findOwner(unsigned long long ticket) const {
+        size_t position = 0;
+        for (size_t step = (tree.size() - 1); step > 0; step >>= 1) {
+            if (position + step < tree.size() && tree[position + step] <= ticket) {
+                position += step;
+                ticket -= tree[position];
+            }
+        }
+        return position;
+    }
+
+    // Grows the tree to a power of two that holds minSize processes and rebuilds it.
+    void grow(size_t minSize) {
+        size_t capacity = 1;
+        while (capacity < minSize) {
+            capacity <<= 1;
+        }
+        tickets.resize(capacity, 0);
+        tree.assign(capacity + 1, 0);
+        for (size_t i = 1; i <= capacity; ++i) {
+            tree[i] += tickets[i - 1];
+            size_t parent = i + (i & (~i + 1));
+            if (parent <= capacity) {
+                tree[parent] += tree[i];
+            }
+        }
+    }
+
+    vector<unsigned long long> tree;
+    vector<unsigned int> tickets;
+    unsigned long long totalTickets;
+    size_t numReadyProcesses;
+    mt19937 random;
+};
+
+// Ready queues of the multi-level feedback queue scheduler, one FIFO per priority level.
+// Bit i of occupiedLevels is set while level i is not empty, so the highest priority ready
+// process is found with a single find-first-set instead of scanning the levels.
+class MultiLevelQueue {
+public:
+    MultiLevelQueue() : numProcesses(0), occupiedLevels(0) {}
+
+    bool empty() const {
+        return occupiedLevels == 0;
+    }
+
+    size_t size() const {
+        return numProcesses;
+    }
+
+    // Gets the highest priority (lowest numbered) non-empty level. The queue must not be empty.
+    unsigned int highestLevel() const {
+        return __builtin_ctz(occupiedLevels);
+    }
+
+    void push(int process, unsigned int level) {
+        levels[level].push_back(process);
+        occupiedLevels |= 1u << level;
+        numProcesses++;
+    }
+
+    // Removes and returns the process at the front of the highest priority level.
+    int pop() {
+        unsigned int level = highestLevel();
+        int process = levels[level].front();
+        levels[level].pop_front();
+        numProcesses--;
+        if (levels[level].empty()) {
+            occupiedLevels &= ~(1u << level);
+        }
+        return process;
+    }
+
+    // Moves every ready process to level 0, keeping them in priority order.
+    void boost() {
+        for (unsigned int level = 1; level < NUM_PRIORITY_LEVELS; ++level) {
+            levels[0].insert(levels[0].end(), levels[level].begin(), levels[level].end());
+            levels[level].clear();
+        }
+        occupiedLevels = levels[0].empty() ? 0 : 1;
+    }
+
+    deque<int> levels[NUM_PRIORITY_LEVELS];
+
+private:
+    size_t numProcesses;
+    uint32_t occupiedLevels;
+};
+
+/**
+ * Multi-level feedback queue. A process is demoted one level when it uses its whole slice and
+ * promoted one level when it blocks before that, every level down doubles the slice, and every
+ * agingInterval quanta all processes are boosted back to level 0 so CPU-bound processes at the
+ * bottom cannot starve.
+ */
+class MlfqScheduler : public Scheduler {
+public:
+    MlfqScheduler(SimulationContext &context, unsigned int agingInterval)
+        : Scheduler(context), agingInterval(agingInterval), lastBoostTime(context.timestamp) {}
+
+    void enqueue(int process) override {
+        readyQueues.push(process, context.pcbTable[process].priority);
+    }
+
+    int pickNext() override {
+        return readyQueues.empty() ? -1 : readyQueues.pop();
+    }
+
+    void onBlock(int process) override {
+        if (context.pcbTable[process].priority > 0) {
+            context.pcbTable[process].priority--;
+        }
+    }
+
+    void onTick() override {
+        if (context.timestamp - lastBoostTime < agingInterval) {
+            return;
+        }
+
+        // Only the ready processes and the running one are boosted here. Blocked processes are
+        // boosted by onUnblock(), so a boost does not cost time for the whole table.
+        for (unsigned int level = 1; level < NUM_PRIORITY_LEVELS; ++level) {
+            for (int process: readyQueues.levels[level]) {
+                context.pcbTable[process].priority = 0;
+            }
+        }
+        readyQueues.boost();
+
+        if (context.runningState != -1) {
+            context.pcbTable[context.runningState].priority = 0;
+            context.cpu.timeSlice = timeSliceFor(context.runningState);
+        }
+        lastBoostTime = context.timestamp;
+    }
+
+    void onUnblock(int process) override {
+        // The process missed the boosts since it blocked (at its stateTime).
+        if (context.pcbTable[process].stateTime < lastBoostTime) {
+            context.pcbTable[process].priority = 0;
+        }
+    }
+
+    bool shouldPreempt(int running, bool sliceExpired) override {
+        PcbEntry& running_pro = context.pcbTable[running];
+        if (sliceExpired && running_pro.priority + 1 < NUM_PRIORITY_LEVELS) {
+            running_pro.priority++;
+        }
+
+        // A ready process of higher priority always wins. One of the same priority only gets
+        // the CPU once the running process has used up its slice (round-robin within a level).
+        return !readyQueues.empty()
+            && (readyQueues.highestLevel() < running_pro.priority
+                || (sliceExpired && readyQueues.highestLevel() == running_pro.priority));
+    }
+
+    unsigned int timeSliceFor(int process) const override {
+        // Saturate, as a long slice at the bottom levels would not fit.
+        unsigned int priority = context.pcbTable[process].priority;
+        return context.timeSliceLength > (UINT_MAX >> priority)
+            ? UINT_MAX : context.timeSliceLength << priority;
+    }
+
+    void listReady(vector<int> &processes) const override {
+        processes.clear();
+        for (const deque<int>& level: readyQueues.levels) {
+            processes.insert(processes.end(), level.begin(), level.end());
+        }
+    }
+
+    size_t numReady() const override {
+        return readyQueues.size();
+    }
+
+    string saveState() const override {
+        return to_string(lastBoostTime);
+    }
+
+    void restoreState(const string &state) override {
+        lastBoostTime = strtoul(state.c_str(), NULL, 10);
+    }
+
+private:
+    MultiLevelQueue readyQueues;
+    unsigned int agingInterval;
+    unsigned int lastBoostTime;
+};
+
+/**
+ * Creates the scheduler of a policy.
+ * @param context the simulation whose processes are scheduled
+ * @param policy the scheduling policy
+ * @param agingInterval the aging interval of the MLFQ policy
+ * @param seed the random seed of the lottery policy
+ */
+unique_ptr<Scheduler> createScheduler(SimulationContext &context, SchedulerPolicy policy,
+                                      unsigned int agingInterval, unsigned int seed) {
+    switch (policy) {
+        case POLICY_FCFS:
+            return unique_ptr<Scheduler>(new FcfsScheduler(context));
+        case POLICY_SJF:
+            return unique_ptr<Scheduler>(new SjfScheduler(context));
+        case POLICY_SRTF:
+            return unique_ptr<Scheduler>(new SrtfScheduler(context));
+        case POLICY_PRIORITY:
+            return unique_ptr<Scheduler>(new PriorityScheduler(context));
+        case POLICY_LOTTERY:
+            return unique_ptr<Scheduler>(new LotteryScheduler(context, seed));
+        case POLICY_MLFQ:
+            return unique_ptr<Scheduler>(new MlfqScheduler(context, agingInterval));
+        default:
+            return unique_ptr<Scheduler>(new RoundRobinScheduler(context));
+    }
+}
+
+/**
+ * Swaps the context of an SMP CPU into cpu, runningState and scheduler.
+ * @param index the index of the CPU
+ */
+void bindCpu(SimulationContext &context, int index) {
+    swap(context.cpu, context.cpus[index].cpu);
+    swap(context.runningState, context.cpus[index].runningState);
+    swap(context.scheduler, context.cpus[index].scheduler);
+    context.boundCpu = index;
+}
+
+/**
+ * Swaps the context of the bound SMP CPU back out of cpu, runningState and scheduler.
+ */
+void unbindCpu(SimulationContext &context) {
+    swap(context.cpu, context.cpus[context.boundCpu].cpu);
+    swap(context.runningState, context.cpus[context.boundCpu].runningState);
+    swap(context.scheduler, context.cpus[context.boundCpu].scheduler);
+    context.boundCpu = -1;
+}
+
+// Command-line options of the simulator.
+class SimulatorOptions {
+public:
+    // Command script to run headless, "-" for stdin. Empty runs the interactive commander.
+    string scriptPath;
+    // Command scripts to run headless at once, each fed by its own producer thread.
+    vector<string> producerScripts;
+    // Whether the commander talks to the process manager over shared memory instead of a pipe.
+    bool useSharedMemory = false;
+    // Number of quanta in a time slice.
+    unsigned int timeSlice = 5;
+    SchedulerPolicy scheduler = POLICY_ROUND_ROBIN;
+    unsigned int agingInterval = 100;
+    unsigned int seed = 1;
+    // Number of simulated CPUs and of host threads running them.
+    unsigned int numCpus = 1;
+    unsigned int numCpuThreads = 1;
+    LogLevel logLevel = LOG_NORMAL;
+    // Format of the P command, and where it goes ("-" for stdout, "fd:<n>", or a file).
+    PrintFormat printFormat = PRINT_TEXT;
+    string printOutput;
+    // Trace file to record the run into, and trace file to replay instead of running.
+    string recordPath;
+    string replayPath;
+    // Simulated time at which the replay stops, -1 for the end of the trace.
+    long long replayUntil = -1;
+    string checkpointPath;
+    unsigned int checkpointInterval = 0;
+    string restorePath;
+    // Number of simulations of the script to run at once (one per seed), and host threads.
+    unsigned int sweepCount = 0;
+    // The policies, time slices and CPU counts to sweep; every combination is simulated.
+    vector<SchedulerPolicy> sweepPolicies;
+    vector<unsigned int> sweepTimeSlices;
+    vector<unsigned int> sweepCpuCounts;
+    unsigned int sweepThreads = max(1u, thread::hardware_concurrency());
+};
+
+// A file mapped read-only into memory. Files that cannot be mapped (pipes, devices) are read
+// into a buffer instead, so callers always see the whole file as one array.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+        if (mapping != MAP_FAILED) {
+            munmap(mapping, size);
+        }
+    }
+
+    // Maps the file. Returns false, with errno set, if it cannot be opened or read.
+    bool map(const string &path) {
+        int fileDescriptor = open(path.c_str(), O_RDONLY);
+        if (fileDescriptor == -1) {
+            return false;
+        }
+        struct stat fileInfo;
+        bool loaded = fstat(fileDescriptor, &fileInfo) == 0;
+        if (loaded && S_ISREG(fileInfo.st_mode) && fileInfo.st_size > 0) {
+            mapping = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+            if (mapping != MAP_FAILED) {
+                size = fileInfo.st_size;
+                data = static_cast<const char *>(mapping);
+                madvise(mapping, size, MADV_SEQUENTIAL);
+            }
+        }
+        while (loaded && mapping == MAP_FAILED) {
+            char chunk[65536];
+            ssize_t numRead = read(fileDescriptor, chunk, sizeof(chunk));
+            if (numRead > 0) {
+                buffer.insert(buffer.end(), chunk, chunk + numRead);
+            }
+            else if (numRead == 0) {
+                data = buffer.data();
+                size = buffer.size();
+                break;
+            }
+            else if (errno != EINTR) {
+                loaded = false;
+            }
+        }
+        int error = errno;
+        close(fileDescriptor);
+        errno = error;
+        return loaded;
+    }
+
+    const char *data = NULL;
+    size_t size = 0;
+
+private:
+    void *mapping = MAP_FAILED;
+    vector<char> buffer;
+};
+
+// Whether the character is whitespace in the "C" locale.
+inline bool isBlank(char character) {
+    return character == ' ' || (character >= '\t' && character <= '\r');
+}
+
+// Marks the newlines of a program file: bit i of bitmap[w] is set if data[64 * w + i] is '\n'.
+// The bitmap has a word for every 64 bytes, the last one partly used.
+typedef void (*NewlineMarkerFunction)(const char *data, size_t size, uint64_t *bitmap);
+
+void markNewlinesScalar(const char *data, size_t size, uint64_t *bitmap) {
+    for (size_t word = 0; word * 64 < size; ++word) {
+        const char *block = data + word * 64;
+        size_t blockSize = min<size_t>(64, size - word * 64);
+        uint64_t bits = 0;
+        for (size_t i = 0; i < blockSize; ++i) {
+            bits |= (uint64_t) (block[i] == '\n') << i;
+        }
+        bitmap[word] = bits;
+    }
+}
+
+#ifdef SIMULATOR_X86_SIMD
+// Compares 16 bytes at a time. The tail of fewer than 64 bytes is marked by the scalar loop.
+__attribute__((target("sse4.2")))
+void markNewlinesSse42(const char *data, size_t size, uint64_t *bitmap) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t numFullWords = size / 64;
+    for (size_t word = 0; word < numFullWords; ++word) {
+        const char *block = data + word * 64;
+        uint64_t bits = 0;
+        for (int i = 0; i < 4; ++i) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 16 * i));
+            uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline));
+            bits |= (uint64_t) mask << (16 * i);
+        }
+        bitmap[word] = bits;
+    }
+    markNewlinesScalar(data + numFullWords * 64, size % 64, bitmap + numFullWords);
+}
+
+// Compares 32 bytes at a time.
+__attribute__((target("avx2")))
+void markNewlinesAvx2(const char *data, size_t size, uint64_t *bitmap) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t numFullWords = size / 64;
+    for (size_t word = 0; word < numFullWords; ++word) {
+        const char *block = data + word * 64;
+        __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block));
+        __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block + 32));
+        uint32_t lowMask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(low, newline));
+        uint32_t highMask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(high, newline));
+        bitmap[word] = (uint64_t) highMask << 32 | lowMask;
+    }
+    markNewlinesScalar(data + numFullWords * 64, size % 64, bitmap + numFullWords);
+}
+#endif
+
+// An implementation of the newline marker, and the instruction set it needs.
+class NewlineMarker {
+public:
+    const char *name;
+    NewlineMarkerFunction mark;
+};
+
+// The implementations, from the most portable to the fastest.
+const NewlineMarker newlineMarkers[] = {
+    {"scalar", markNewlinesScalar},
+#ifdef SIMULATOR_X86_SIMD
+    {"sse4.2", markNewlinesSse42},
+    {"avx2", markNewlinesAvx2},
+#endif
+};
+const int NUM_NEWLINE_MARKERS = sizeof(newlineMarkers) / sizeof(newlineMarkers[0]);
+
+/**
+ * Picks the fastest newline marker the CPU supports.
+ */
+const NewlineMarker *selectNewlineMarker() {
+#ifdef SIMULATOR_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &newlineMarkers[2];
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return &newlineMarkers[1];
+    }
+#endif
+    return &newlineMarkers[0];
+}
+
+// The newline marker used by createProgram(), picked once at startup.
+const NewlineMarker *newlineMarker = selectNewlineMarker();
+
+/**
+ * Starts the error message of an invalid line of a program file. Errors are rare, so this is
+ * kept out of line, away from the decoding loop.
+ * @return the stream to finish the message on
+ */
+__attribute__((cold, noinline))
+ostream &programError(SimulationContext &context, const string &filename, int lineNum) {
+    context.eventLog.flush();
+    return *context.output << filename << ":" << lineNum;
+}
+
+/**
+ * Decodes the integer argument of an instruction the way stream extraction does: an optional
+ * sign, then the digits up to the first other character.
+ * @return false if there are no digits or the number does not fit
+ */
+inline bool parseIntArgument(const char *start, const char *end, int32_t &value) {
+    const char *digits = start + (start < end && (*start == '-' || *start == '+'));
+    const char *digitsEnd = digits;
+    while (digitsEnd < end && (unsigned char) (*digitsEnd - '0') < 10) {
+        ++digitsEnd;
+    }
+
+    // Up to 9 digits always fit, so the common short numbers skip from_chars().
+    if (digitsEnd > digits && digitsEnd - digits <= 9) {
+        int32_t magnitude = 0;
+        for (const char *digit = digits; digit < digitsEnd; ++digit) {
+            magnitude = magnitude * 10 + (*digit - '0');
+        }
+        value = *start == '-' ? -magnitude : magnitude;
+        return true;
+    }
+    return digitsEnd > digits
+        && from_chars(*start == '+' ? digits : start, digitsEnd, value).ec == errc();
+}
+
+/**
+ * Decodes a line of a program file: the line is trimmed, its first character is the operation
+ * and the rest its argument.
+ * @param lineNum the number of the line, for error messages
+ * @param lineStart the first character of the line
+ * @param lineEnd the end of the line (its newline, or the end of the file)
+ * @param program the program to append the instruction to (blank lines add none)
+ * @return false (after printing the file, the line and why) if the line is invalid
+ */
+inline bool parseProgramLine(SimulationContext &context, const string &filename, int lineNum,
+                             const char *lineStart, const char *lineEnd,
+                             vector<Instruction> &program) {
+    // 1. Trim the line.
+    while (lineStart < lineEnd && isBlank(*lineStart)) {
+        ++lineStart;
+    }
+    while (lineEnd > lineStart && isBlank(lineEnd[-1])) {
+        --lineEnd;
+    }
+    if (lineStart == lineEnd) {
+        return true;
+    }
+
+    // 2. Split off the operation and decode the argument.
+    Instruction instruction;
+    instruction.operation = toupper((unsigned char) *lineStart);
+    instruction.intArg = 0;
+    const char *argumentStart = lineStart + 1;
+    while (argumentStart < lineEnd && isBlank(*argumentStart)) {
+        ++argumentStart;
+    }
+    string_view argument(argumentStart, lineEnd - argumentStart);
+
+    switch (instruction.operation) {
+        case 'S': // Integer argument.
+        case 'A': // Integer argument.
+        case 'D': // Integer argument.
+        case 'F': // Integer argument.
+            if (!parseIntArgument(argumentStart, lineEnd, instruction.intArg)) {
+                programError(context, filename, lineNum)
+                    << " - Invalid integer argument " << argument << " for "
+                    << instruction.operation << " operation" << endl;
+                return false;
+            }
+            break;
+        case 'B': // No argument.
+        case 'E': // No argument.
+            break;
+        case 'R': // String argument.
+            // Note that since the string is trimmed on both ends, filenames
+            // with leading or trailing whitespace (unlikely) will not work.
+            if (argument.empty()) {
+                programError(context, filename, lineNum) << " -Missing string argument" << endl;
+                return false;
+            }
+            instruction.intArg = internedStrings.intern(argument);
+            break;
+        default:
+            programError(context, filename, lineNum)
+                << " - Invalid operation, " << instruction.operation << endl;
+            return false;
+    }
+
+    program.push_back(instruction);
+    return true;
+}
+
+/**
+ * Parses a program file into instructions. The file is mapped and scanned in place, a window
+ * at a time: the newlines of the window are marked with SIMD compares, then the lines ending
+ * in it are decoded.
+ * @param filename the path of the program file
+ * @param program set to the instructions of the file
+ * @return false (after printing the file, the line and why) if the file cannot be parsed
+ */
+bool createProgram(SimulationContext &context, const string &filename, vector<Instruction> &program) {
+    const size_t WINDOW_SIZE = 64 * 1024;
+    program.clear();
+
+    MappedFile file;
+    if (!file.map(filename)) {
+        char* currDir = getcwd(NULL, 0);
+        context.eventLog.flush();
+        *context.output << "Error opening file " << filename << "\" in \"" << currDir << "\"" << endl;
+        free(currDir);
+        return false;
+    }
+
+    uint64_t bitmap[WINDOW_SIZE / 64];
+    const char *lineStart = file.data;
+    int lineNum = 0;
+    for (size_t windowOffset = 0; windowOffset < file.size; windowOffset += WINDOW_SIZE) {
+        // 1. Mark the newlines of the window.
+        const char *window = file.data + windowOffset;
+        size_t windowSize = min(WINDOW_SIZE, file.size - windowOffset);
+        newlineMarker->mark(window, windowSize, bitmap);
+
+        // 2. Decode the lines that end in the window, one set bit at a time.
+        for (size_t word = 0; word * 64 < windowSize; ++word) {
+            for (uint64_t bits = bitmap[word]; bits != 0; bits &= bits - 1) {
+                const char *lineEnd = window + word * 64 + __builtin_ctzll(bits);
+                if (!parseProgramLine(context, filename, lineNum++, lineStart, lineEnd, program)) {
+                    return false;
+                }
+                lineStart = lineEnd + 1;
+            }
+        }
+    }
+
+    // 3. The last line may not end with a newline.
+    const char *end = file.data + file.size;
+    return lineStart == end || parseProgramLine(context, filename, lineNum, lineStart, end,
+                                                program);
+}
+
+// A cached program together with the identity of the file it was decoded from.
+class ProgramCacheEntry {
+public:
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec modifiedTime;
+    ProgramPtr program;
+};
+
+// Decoded programs keyed by path, so hot programs are parsed only once. The cache is shared by
+// all simulations of the process: the programs are immutable, and the map is guarded by
+// programCacheMutex, which lookups only share.
+unordered_map<string, ProgramCacheEntry> programCache;
+shared_mutex programCacheMutex;
+
+// Program given to a process whose R operation failed, so that it ends on its next quantum.
+const ProgramPtr emptyProgram = make_shared<const vector<Instruction>>();
+
+/**
+ * Gets the decoded program of a file from the program cache. The file is only parsed
+ * (through createProgram()) when it is not cached yet or when its device, inode, size or
+ * modification time changed since it was cached. Simulations that reuse cached programs
+ * (sweeps) skip that check for programs already cached.
+ * @param filename the path of the program file
+ * @return the shared program, or an empty pointer if the file could not be loaded
+ */
+ProgramPtr loadProgram(SimulationContext &context, const string &filename) {
+    if (context.reuseCachedPrograms) {
+        shared_lock<shared_mutex> lock(programCacheMutex);
+        unordered_map<string, ProgramCacheEntry>::iterator cached = programCache.find(filename);
+        if (cached != programCache.end()) {
+            return cached->second.program;
+        }
+    }
+
+    unique_lock<shared_mutex> lock(programCacheMutex);
+    struct stat fileInfo;
+    if (stat(filename.c_str(), &fileInfo) == -1) {
+        // Let createProgram() report why the file cannot be opened.
+        vector<Instruction> program;
+        createProgram(context, filename, program);
+        programCache.erase(filename);
+        return ProgramPtr();
+    }
+
+    unordered_map<string, ProgramCacheEntry>::iterator cached = programCache.find(filename);
+    if (cached != programCache.end()) {
+        const ProgramCacheEntry &entry = cached->second;
+        if (entry.device == fileInfo.st_dev && entry.inode == fileInfo.st_ino
+            && entry.size == fileInfo.st_size
+            && entry.modifiedTime.tv_sec == fileInfo.st_mtim.tv_sec
+            && entry.modifiedTime.tv_nsec == fileInfo.st_mtim.tv_nsec) {
+            return entry.program;
+        }
+    }
+
+    shared_ptr<vector<Instruction>> program = make_shared<vector<Instruction>>();
+    if (!createProgram(context, filename, *program)) {
+        programCache.erase(filename);
+        return ProgramPtr();
+    }
+
+    ProgramCacheEntry &entry = programCache[filename];
+    entry.device = fileInfo.st_dev;
+    entry.inode = fileInfo.st_ino;
+    entry.size = fileInfo.st_size;
+    entry.modifiedTime = fileInfo.st_mtim;
+    entry.program = program;
+    return entry.program;
+}
+
+/**
+ * Gets a free PCB slot, growing the table if no reclaimed slot is available.
+ * @return the index of a PCB entry reset to its default values.
+ */
+int allocatePcb(SimulationContext &context) {
+    int index;
+    if (!context.freePcbSlots.empty()) {
+        index = context.freePcbSlots.back();
+        context.freePcbSlots.pop_back();
+        context.pcbTable[index] = PcbEntry();
+    }
+    else {
+        index = context.pcbTable.size();
+        context.pcbTable.push_back(PcbEntry());
+    }
+
+    // Append the process to the list of live processes.
+    PcbEntry &entry = context.pcbTable[index];
+    entry.previousLive = context.lastLivePcb;
+    entry.nextLive = -1;
+    if (context.lastLivePcb != -1) {
+        context.pcbTable[context.lastLivePcb].nextLive = index;
+    }
+    else {
+        context.firstLivePcb = index;
+    }
+    context.lastLivePcb = index;
+    return index;
+}
+
+/**
+ * Marks a PCB slot as empty and puts it back on the free list.
+ * @param index the index of the PCB entry to release
+ */
+void releasePcb(SimulationContext &context, int index) {
+    PcbEntry& entry = context.pcbTable[index];
+    entry.processId = -1;
+    entry.parentProcessId = -1;
+    entry.program.reset();
+    context.freePcbSlots.push_back(index);
+
+    // Unlink the process from the list of live processes.
+    if (entry.previousLive != -1) {
+        context.pcbTable[entry.previousLive].nextLive = entry.nextLive;
+    }
+    else {
+        context.firstLivePcb = entry.nextLive;
+    }
+    if (entry.nextLive != -1) {
+        context.pcbTable[entry.nextLive].previousLive = entry.previousLive;
+    }
+    else {
+        context.lastLivePcb = entry.previousLive;
+    }
+    entry.previousLive = -1;
+    entry.nextLive = -1;
+}
+
+/**
+ * Removes whitespace at the start and the end of the string
+ * @param trimmed_str the string which needs to be trimmed.
+ * @return the trimmed string without whitespaces at beginning and end of the string.
+ */
+//string trim(string trimmed_str)
+//{
+//    int front = trimmed_str.find_first_not_of(' ');
+//    int rear = trimmed_str.find_last_not_of(' ');
+
+//    if (rear == -1 || front == -1) {
+//        return "";
+//    }
+
+//    return trimmed_str.substr(front, rear - front + 1);
+//}
+
+/**
+ * Prints the outcome of an S, A or D operation.
+ * @param operation the operation
+ * @param value the operand of the operation
+ */
+void printArithmetic(SimulationContext &context, char operation, int32_t value) {
+    switch (operation) {
+        case 'S':
+            logEvent(context, EVENT_SET, value);
+            break;
+        case 'A':
+            logEvent(context, EVENT_ADD, value);
+            break;
+        case 'D':
+            logEvent(context, EVENT_DECREMENT, value);
+            break;
+    }
+}
+
+/**
+ * Implements the S operation and 
+ * Sets the CPU value to the passed-in value.
+ * @param value CPU's value will be set to this value
+*/
+void set(SimulationContext &context, int value) {
+    context.cpu.value = value;
+    printArithmetic(context, 'S', value);
+}
+
+/**
+ * Implements the A operation and 
+ * Adds the passed-in value to the CPU value.
+ * @param value the value which is used to increment CPU's value by this 'value'
+*/
+void add(SimulationContext &context, int value) { 
+    context.cpu.value += value;
+    printArithmetic(context, 'A', value);
+}
+
+/**
+ * Implements the D operation and
+ * Subtracts the integer value from the CPU value.
+ * @param value the value which is used to decrease CPU's value by this 'value'
+*/
+void decrement(SimulationContext &context, int value) {
+    context.cpu.value -= value;
+    printArithmetic(context, 'D', value);
+}
+
+/**
+ * Decides whether the running process has to give up the CPU. A process whose time slice
+ * has expired but keeps the CPU gets a new slice.
+ * @return true if a ready process should run instead
+ */
+bool shouldPreempt(SimulationContext &context) {
+    bool sliceExpired = context.cpu.timeSliceUsed >= context.cpu.timeSlice;
+    bool preempt = context.scheduler->shouldPreempt(context.runningState, sliceExpired);
+
+    if (sliceExpired && !preempt) {
+        context.cpu.timeSlice = context.scheduler->timeSliceFor(context.runningState);
+        context.cpu.timeSliceUsed = 0;
+    }
+    return preempt;
+}
+
+/**
+ * Takes the CPU away from the running process.
+*/
+void preempt(SimulationContext &context) {
+    // 1. Save the CPU context (program counter and value) back into the process's PCB.
+    PcbEntry& running_pro = context.pcbTable[context.runningState];
+    running_pro.programCounter = context.cpu.programCounter;
+    running_pro.value = context.cpu.value;
+
+    // 2. Mark the process as ready and put it at the back of the ready queue.
+    running_pro.state = STATE_READY;
+    running_pro.stateTime = context.timestamp;
+    context.scheduler->enqueue(context.runningState);
+
+    logEvent(context, EVENT_PREEMPT, running_pro.processId);
+    context.runningState = -1;
+}
+
+/**
+ * Implements work stealing in SMP mode: the bound CPU has nothing ready, so it takes a
+ * process from the CPU with the most ready processes.
+ * @return the PCB index of the stolen process, or -1 if no CPU has a ready process
+ */
+int stealReadyProcess(SimulationContext &context) {
+    int victim = -1;
+    size_t mostReady = 0;
+    for (size_t i = 0; i < context.cpus.size(); ++i) {
+        if ((int) i != context.boundCpu && context.cpus[i].scheduler->numReady() > mostReady) {
+            mostReady = context.cpus[i].scheduler->numReady();
+            victim = i;
+        }
+    }
+
+    if (victim == -1) {
+        return -1;
+    }
+    int process = context.cpus[victim].scheduler->pickNext();
+    context.runStats.numSteals++;
+    logEvent(context, EVENT_STEAL, victim, context.pcbTable[process].processId);
+    return process;
+}
+
+/**
+ * Performs scheduling.
+*/
+void schedule(SimulationContext &context) {
+    context.scheduler->onTick();
+
+    // 1. Return if there is still a processing running (runningState != -1) that keeps the
+    //    CPU. The engine charges every executed quantum to the time slice, and a process that
+    //    has to give up the CPU goes back to the ready queue.
+    if (context.runningState != -1) {
+        if (!shouldPreempt(context)) {
+            return;
+        }
+        preempt(context);
+    }
+
+    // 2. Get a new process to run, if possible, from the ready queue. In SMP mode a CPU with
+    //    an empty ready queue steals from another CPU.
+    int nextProcess = context.scheduler->pickNext();
+    if (nextProcess == -1 && context.boundCpu != -1) {
+        nextProcess = stealReadyProcess(context);
+    }
+    if (nextProcess != -1) {
+        // 3. If we were able to get a new process to run:
+        //     a. Mark the processing as running (update the new process's PCB state)
+        //        and its metrics (the time it waited, and its response time on its first run)
+        PcbEntry &next_pro = context.pcbTable[nextProcess];
+        next_pro.state = STATE_RUNNING;
+        next_pro.timeUsed += 1;
+        next_pro.waitingTime += context.timestamp - next_pro.stateTime;
+        next_pro.stateTime = context.timestamp;
+        next_pro.numContextSwitches++;
+        if (next_pro.firstRunTime == -1) {
+            next_pro.firstRunTime = context.timestamp;
+            context.metrics.totalResponseTime += context.timestamp - next_pro.startTime;
+            context.metrics.responseTimes.record(context.timestamp - next_pro.startTime);
+        }
+        context.pcbTable[nextProcess].lastCpu = context.boundCpu == -1 ? 0 : context.boundCpu;
+        //     b. Update the CPU structure with the PCB entry details (program, program counter,
+        //        value, etc.)
+        context.cpu.pProgram = context.pcbTable[nextProcess].program.get();
+        context.cpu.programCounter = context.pcbTable[nextProcess].programCounter;
+        context.cpu.value = context.pcbTable[nextProcess].value;   
+        context.cpu.timeSlice = context.scheduler->timeSliceFor(nextProcess);   
+        context.cpu.timeSliceUsed = 0;   
+
+        // variable 'runningState' updates to the current process's index
+        context.runningState = nextProcess; 
+        context.runStats.numContextSwitches++;
+        logEvent(context, EVENT_RUN, context.pcbTable[nextProcess].processId);
+    }
+}
+
+/**
+ * Implements the B operation.
+*/
+void block(SimulationContext &context) {
+    // TODO: Implement
+    if (context.runningState != -1) {
+        // 1. Add the PCB index of the running process (stored in runningState) to the blocked queue.
+        context.blockedState.emplace_back(context.runningState);
+
+        // 2. Update the process's PCB entry
+        //     a. Change the PCB's state to blocked.
+        context.pcbTable[context.runningState].state = STATE_BLOCKED;
+        context.pcbTable[context.runningState].stateTime = context.timestamp;
+        //     b. Store the CPU program counter in the PCB's program counter.
+        context.pcbTable[context.runningState].programCounter = context.cpu.programCounter;
+        //     c. Store the CPU's value in the PCB's value.
+        context.pcbTable[context.runningState].value = context.cpu.value;
+        //     d. Let the scheduler react to the process giving up the CPU.
+        context.scheduler->onBlock(context.runningState);
+
+        // 3. Update the running state to -1 (basically mark no process as running). 
+        //    Note that a new process will be chosen to run later (via the Q command code calling the schedule() function).
+        logEvent(context, EVENT_BLOCK, context.pcbTable[context.runningState].processId);
+        context.runningState = -1;
+    }
+}
+
+// Implements the E operation.
+void end(SimulationContext &context) {
+    // TODO: Implement
+    if (context.runningState != -1) {
+        // 1. Get the PCB entry of the running process.
+        PcbEntry& running_pro = context.pcbTable[context.runningState];
+
+        // 2. Update the cumulative time difference (increment it by timestamp + 1 - start time of the process).
+        context.cumulativeTimeDiff = context.cumulativeTimeDiff + (context.timestamp + 1 - running_pro.startTime);
+        context.metrics.turnaroundTimes.record(context.timestamp + 1 - running_pro.startTime);
+        context.metrics.totalWaitingTime += running_pro.waitingTime;
+        context.metrics.waitingTimes.record(running_pro.waitingTime);
+        context.metrics.totalBlockedTime += running_pro.blockedTime;
+
+        // 3. Increment the number of terminated processes.
+        context.numTerminatedProcesses++;
+
+        logEvent(context, EVENT_END, running_pro.processId);
+        releasePcb(context, context.runningState);
+
+        // 4. Update the running state to -1 (basically mark no process as running). 
+        //    Note that a new process will be chosen to run later (via the Q command code calling the schedule function).
+        context.runningState = -1;
+    } 
+}
+
+/**
+ * Implements the F operation.
+ * @param value
+*/
+void fork(SimulationContext &context, int value) {
+    // TODO: Implement
+    // 1. Get the PCB entry for the current running process.
+    PcbEntry& parent_pro = context.pcbTable[context.runningState];
+
+    // 2. Ensure the passed-in value is not out of bounds.
+    // 3. Get a free PCB index from the free list (or grow the table).
+    // 4. Populate the PCB entry obtained in #3
+    //     a. Set the process ID to the next unused process ID (context.nextProcessId).
+    //     b. Set the parent process ID to the process ID of the running process 
+    //        (use the running process's PCB entry to get this).
+    //     c. Set the program counter to the cpu program counter.
+    //     d. Set the value to the cpu value.
+    //     e. Set the priority to the same as the parent process's priority.
+    //     f. Set the state to the ready state.
+    //     g. Set the start time to the current timestamp
+    //     h. Share the parent's program image with the child (no copy is made).
+    if ((value >= 0) && (value < (int) parent_pro.program->size())) {
+        int free_PCB_index = allocatePcb(context);
+        context.runStats.numCreatedProcesses++;
+	    PcbEntry& child_pro = context.pcbTable[free_PCB_index];
+        child_pro.processId = context.nextProcessId++;
+        child_pro.parentProcessId = parent_pro.processId;
+        child_pro.programCounter = context.cpu.programCounter;
+        child_pro.value = context.cpu.value;
+        child_pro.priority = parent_pro.priority;
+        child_pro.state = STATE_READY;
+        child_pro.startTime = context.timestamp;
+        child_pro.stateTime = context.timestamp;
+        child_pro.waitingTime = 0;
+        child_pro.blockedTime = 0;
+        child_pro.firstRunTime = -1;
+        child_pro.numContextSwitches = 0;
+        child_pro.lastCpu = parent_pro.lastCpu;
+        child_pro.program = parent_pro.program;
+        logEvent(context, EVENT_FORK, child_pro.processId);
+
+        // 5. Add the pcb index to the ready queue
+        context.scheduler->enqueue(free_PCB_index);
+    }
+
+    // 6. Increment the cpu's program counter by the value read in #3
+    context.cpu.programCounter += value;
+}
+
+/**
+ * Implements the R operation.
+ * @param filenameIndex the index of the program's filename in the string table
+ */ 
+void replace(SimulationContext &context, int32_t filenameIndex) {
+    const string &argument = internedStrings.lookup(filenameIndex);
+    PcbEntry& running_pro = context.pcbTable[context.runningState];
+
+    // 1. Get the program specified by argument from the program cache (loadProgram() only
+    //    calls createProgram() when the file is not cached or has changed).
+    ProgramPtr program = loadProgram(context, argument);
+    // a. Consider what to do if loading fails. [I printed an error, 
+    //    cleared the program, incremented the cpu program counter and then returned.] 
+    //    Note that loading can fail if the file could not be opened or did not exist.
+    if (!program)
+    {
+        logEvent(context, EVENT_REPLACE_FAILED, running_pro.processId);
+        running_pro.program = emptyProgram;
+        context.cpu.pProgram = running_pro.program.get();
+        context.cpu.programCounter++;
+        return;
+    }
+
+    // 2. Swap the shared program into the PCB and the CPU.
+    running_pro.program = program;
+    context.cpu.pProgram = running_pro.program.get();
+
+    // 3. Set the program counter to 0.
+    context.cpu.programCounter = 0;
+    logEvent(context, EVENT_REPLACE, context.pcbTable[context.runningState].processId, filenameIndex, &argument);
+}
+
+// GCC and Clang can take the address of a label, which lets the interpreter jump straight from
+// one instruction handler to the next (threaded dispatch). Other compilers use a switch.
+#ifndef USE_THREADED_DISPATCH
+#if defined(__GNUC__)
+#define USE_THREADED_DISPATCH 1
+#else
+#define USE_THREADED_DISPATCH 0
+#endif
+#endif
+
+/**
+ * Execution engine of the Q command. Runs the running process for up to maxQuanta quanta
+ * (one instruction per quantum) and returns early once the process leaves the CPU, i.e.
+ * when its time slice expires, it blocks or it ends. Instructions are fetched by reference.
+ * @param maxQuanta the most quanta to run
+ * @return the number of quanta that were run
+ */
+unsigned int executeSlice(SimulationContext &context, unsigned int maxQuanta) {
+    const int process = context.runningState;
+    Cpu &cpu = context.cpu;
+    unsigned int executed = 0;
+    const Instruction *instruction = NULL;
+    char operation;
+
+    // Fetches the next instruction, or stops once the quanta are used up or the process
+    // is no longer running.
+#define FETCH_INSTRUCTION()                                                   \
+    if (executed == maxQuanta || context.runningState != process) {           \
+        return executed;                                                      \
+    }                                                                         \
+    logEvent(context, EVENT_QUANTUM, -1);                                     \
+    if ((size_t) cpu.programCounter < cpu.pProgram->size()) {                 \
+        instruction = &(*cpu.pProgram)[cpu.programCounter];                   \
+        operation = instruction->operation;                                   \
+        ++cpu.programCounter;                                                 \
+    }                                                                         \
+    else {                                                                    \
+        logEvent(context, EVENT_END_OF_PROGRAM);                              \
+        operation = 'E';                                                      \
+    }
+
+#if USE_THREADED_DISPATCH
+    // Per host thread, as simulations may run on several threads at once.
+    static thread_local void *dispatchTable[256];
+    static thread_local bool dispatchTableReady = false;
+    if (!dispatchTableReady) {
+        for (int i = 0; i < 256; ++i) {
+            dispatchTable[i] = &&op_none;
+        }
+        dispatchTable[(unsigned char) 'S'] = &&op_set;
+        dispatchTable[(unsigned char) 'A'] = &&op_add;
+        dispatchTable[(unsigned char) 'D'] = &&op_decrement;
+        dispatchTable[(unsigned char) 'B'] = &&op_block;
+        dispatchTable[(unsigned char) 'E'] = &&op_end;
+        dispatchTable[(unsigned char) 'F'] = &&op_fork;
+        dispatchTable[(unsigned char) 'R'] = &&op_replace;
+        dispatchTableReady = true;
+    }
+
+#define HANDLER(label, op) label:
+#define DEFAULT_HANDLER(label) label:
+#define END_HANDLER()                                                         \
+    context.timestamp++;                                                      \
+    ++cpu.timeSliceUsed;                                                      \
+    schedule(context);                                                        \
+    ++executed;                                                               \
+    FETCH_INSTRUCTION();                                                      \
+    goto *dispatchTable[(unsigned char) operation]
+
+    FETCH_INSTRUCTION();
+    goto *dispatchTable[(unsigned char) operation];
+#else
+#define HANDLER(label, op) case op:
+#define DEFAULT_HANDLER(label) default:
+#define END_HANDLER() break
+
+    for (;;) {
+        FETCH_INSTRUCTION();
+        switch (operation) {
+#endif
+
+    HANDLER(op_set, 'S')
+        set(context, instruction->intArg);
+        END_HANDLER();
+    HANDLER(op_add, 'A')
+        add(context, instruction->intArg);
+        END_HANDLER();
+    HANDLER(op_decrement, 'D')
+        decrement(context, instruction->intArg);
+        END_HANDLER();
+    HANDLER(op_block, 'B')
+        block(context);
+        END_HANDLER();
+    HANDLER(op_end, 'E')
+        end(context);
+        END_HANDLER();
+    HANDLER(op_fork, 'F')
+        fork(context, instruction->intArg);
+        END_HANDLER();
+    HANDLER(op_replace, 'R')
+        // The operand is read before the old program can be released by replace().
+        replace(context, instruction->intArg);
+        END_HANDLER();
+    DEFAULT_HANDLER(op_none)
+        END_HANDLER();
+
+#if !USE_THREADED_DISPATCH
+        }
+        context.timestamp++;
+        ++cpu.timeSliceUsed;
+        schedule(context);
+        ++executed;
+    }
+#endif
+
+#undef HANDLER
+#undef DEFAULT_HANDLER
+#undef END_HANDLER
+#undef FETCH_INSTRUCTION
+}
+
+/**
+ * Waits until a futex word no longer holds the expected value, or until the timeout.
+ */
+void futexWait(atomic<uint32_t> *word, uint32_t expected, const struct timespec *timeout) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT, expected, timeout, NULL, 0);
+}
+
+/**
+ * Wakes up every thread or process waiting on a futex word.
+ */
+void futexWake(atomic<uint32_t> *word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Host threads that run the execute phase of SMP ticks. Thread t (the calling thread is
+ * thread 0) executes every CPU whose index is t modulo the number of threads. A thread that
+ * finds no work spins briefly, as the next tick usually follows right after the commit phase,
+ * then sleeps on a futex, so idle threads do not keep host cores busy.
+ */
+class CpuThreadPool {
+public:
+    explicit CpuThreadPool(unsigned int numThreads)
+        : numThreads(numThreads), generation(0), pending(0), numSleeping(0), callerWaiting(0),
+          stopping(false) {
+        for (unsigned int t = 1; t < numThreads; ++t) {
+            threads.emplace_back(&CpuThreadPool::workerLoop, this, t);
+        }
+    }
+
+    ~CpuThreadPool() {
+        stopping.store(true, memory_order_relaxed);
+        generation.fetch_add(1);
+        futexWake(&generation);
+        for (thread &worker: threads) {
+            worker.join();
+        }
+    }
+
+    // Runs work(context, thread, numThreads) on every thread and waits until all are done.
+    void run(SimulationContext &context,
+             void (*tickWork)(SimulationContext &, unsigned int, unsigned int)) {
+        workContext = &context;
+        work = tickWork;
+        pending.store(numThreads - 1, memory_order_relaxed);
+        // The stores are sequentially consistent, like the sleepers' flags: a sleeper sets
+        // its flag and then re-checks the word, the other side changes the word and then
+        // checks the flag, so a wake-up is never missed.
+        generation.fetch_add(1);
+        if (numSleeping.load() > 0) {
+            futexWake(&generation);
+        }
+        work(context, 0, numThreads);
+
+        uint32_t numPending;
+        for (unsigned int spins = 0; (numPending = pending.load()) != 0; ++spins) {
+            if (spins < SPIN_LIMIT) {
+                this_thread::yield();
+                continue;
+            }
+            callerWaiting.store(1);
+            if (pending.load() == numPending) {
+                futexWait(&pending, numPending, NULL);
+            }
+            callerWaiting.store(0);
+        }
+    }
+
+private:
+    // Number of times a thread yields while waiting before it goes to sleep.
+    static const unsigned int SPIN_LIMIT = 100;
+
+    void workerLoop(unsigned int index) {
+        uint32_t seen = 0;
+        for (;;) {
+            uint32_t current;
+            for (unsigned int spins = 0; (current = generation.load()) == seen; ++spins) {
+                if (spins < SPIN_LIMIT) {
+                    this_thread::yield();
+                    continue;
+                }
+                numSleeping.fetch_add(1);
+                if (generation.load() == seen) {
+                    futexWait(&generation, seen, NULL);
+                }
+                numSleeping.fetch_sub(1);
+            }
+            seen = current;
+            if (stopping.load(memory_order_relaxed)) {
+                return;
+            }
+
+            work(*workContext, index, numThreads);
+            if (pending.fetch_sub(1) == 1 && callerWaiting.load()) {
+                futexWake(&pending);
+            }
+        }
+    }
+
+    unsigned int numThreads;
+    vector<thread> threads;
+    SimulationContext *workContext;
+    void (*work)(SimulationContext &, unsigned int, unsigned int);
+    // Futex words: the number of ticks handed out so far and the threads still working on
+    // the current one.
+    atomic<uint32_t> generation;
+    atomic<uint32_t> pending;
+    atomic<uint32_t> numSleeping;
+    atomic<uint32_t> callerWaiting;
+    atomic<bool> stopping;
+};
+
+SimulationContext::~SimulationContext() {}
+
+/**
+ * Execute phase of an SMP tick: every CPU fetches the next instruction of its process and
+ * runs it if it only touches the CPU's own registers (S, A and D). Other operations change
+ * shared state and are left for the commit phase. CPUs never touch each other here, so the
+ * phase can run on several host threads.
+ * @param thread the index of the host thread
+ * @param numThreads the number of host threads
+ */
+void executeSmpTick(SimulationContext &context, unsigned int thread, unsigned int numThreads) {
+    for (size_t i = thread; i < context.cpus.size(); i += numThreads) {
+        CpuContext &cpuContext = context.cpus[i];
+        cpuContext.ranProcess = cpuContext.runningState != -1;
+        if (!cpuContext.ranProcess) {
+            continue;
+        }
+
+        Cpu &regs = cpuContext.cpu;
+        if ((size_t) regs.programCounter < regs.pProgram->size()) {
+            const Instruction &instruction = (*regs.pProgram)[regs.programCounter];
+            cpuContext.operation = instruction.operation;
+            cpuContext.operand = instruction.intArg;
+            ++regs.programCounter;
+        }
+        else {
+            // Reported in the commit phase as the end of the program.
+            cpuContext.operation = 0;
+        }
+
+        switch (cpuContext.operation) {
+            case 'S':
+                regs.value = cpuContext.operand;
+                break;
+            case 'A':
+                regs.value += cpuContext.operand;
+                break;
+            case 'D':
+                regs.value -= cpuContext.operand;
+                break;
+        }
+    }
+}
+
+/**
+ * Runs one tick of all CPUs in SMP mode. After the execute phase, the commit phase reports
+ * every CPU's instruction and runs the operations that change shared state, in CPU order, so
+ * the outcome does not depend on how the host threads were scheduled. Then every CPU
+ * schedules, idle ones included, which is when they steal work.
+ */
+void smpTick(SimulationContext &context) {
+    if (context.cpuThreadPool) {
+        context.cpuThreadPool->run(context, executeSmpTick);
+    }
+    else {
+        executeSmpTick(context, 0, 1);
+    }
+
+    for (size_t i = 0; i < context.cpus.size(); ++i) {
+        logEvent(context, EVENT_QUANTUM, i);
+        if (!context.cpus[i].ranProcess) {
+            logEvent(context, EVENT_IDLE);
+            context.metrics.numIdleQuanta++;
+            continue;
+        }
+
+        char operation = context.cpus[i].operation;
+        int32_t operand = context.cpus[i].operand;
+        bindCpu(context, i);
+        switch (operation) {
+            case 'S':
+            case 'A':
+            case 'D':
+                printArithmetic(context, operation, operand);
+                break;
+            case 'B':
+                block(context);
+                break;
+            case 'E':
+                end(context);
+                break;
+            case 'F':
+                fork(context, operand);
+                break;
+            case 'R':
+                replace(context, operand);
+                break;
+            case 0:
+                logEvent(context, EVENT_END_OF_PROGRAM);
+                end(context);
+                break;
+        }
+        unbindCpu(context);
+    }
+
+    context.timestamp++;
+    for (size_t i = 0; i < context.cpus.size(); ++i) {
+        bindCpu(context, i);
+        if (context.runningState != -1) {
+            ++context.cpu.timeSliceUsed;
+        }
+        schedule(context);
+        unbindCpu(context);
+    }
+}
+
+/**
+ * Implements the Q command.
+ * @param count the number of quanta to run
+ */
+void quantum(SimulationContext &context, unsigned int count) {
+    if (!context.cpus.empty()) {
+        for (unsigned int i = 0; i < count; ++i) {
+            smpTick(context);
+        }
+        return;
+    }
+
+    while (count > 0) {
+        if (context.runningState == -1) {
+            logEvent(context, EVENT_QUANTUM, -1);
+            logEvent(context, EVENT_IDLE);
+            context.metrics.numIdleQuanta++;
+            ++context.timestamp;
+            --count;
+            continue;
+        }
+
+        count -= executeSlice(context, count);
+    }
+}
+
+/**
+ * Implements the U command.
+*/
+void unblock(SimulationContext &context) {
+    // If the blocked queue contains any processes:
+    if (!context.blockedState.empty()) {
+        //  a. Remove a process form the front of the blocked queue.
+        int next_process = context.blockedState.front();
+        context.blockedState.pop_front();
+        //  b. Change the state of the process to ready (update its PCB entry).
+        context.scheduler->onUnblock(next_process);
+        context.pcbTable[next_process].state = STATE_READY;
+        context.pcbTable[next_process].blockedTime += context.timestamp - context.pcbTable[next_process].stateTime;
+        context.pcbTable[next_process].stateTime = context.timestamp;
+        //  c. Add the process to the ready queue.
+        context.scheduler->enqueue(next_process);
+        //  d. Call the schedule() function to give an unblocked process a chance to run (if possible).
+        schedule(context);
+        logEvent(context, EVENT_UNBLOCK, context.pcbTable[next_process].processId);
+    }
+}
+
+/**
+ * Implements the helper function of print function below to execute P cmd.
+ * @param state_name the passed name of state of the process which needs to be converted to string
+*/
+string helper_converting_state(State state_name) {
+    if (state_name == STATE_READY) {
+        return "READY";
+    }
+    else if (state_name == STATE_RUNNING) {
+        return "RUNNING";
+    }
+    else if (state_name == STATE_BLOCKED) {
+        return "BLOCKED";
+    }
+    else {
+        return "UNIDENTIFIED!";
+    }
+}
+
+/**
+ * Gets the time a process has spent ready, including its current stay in a ready queue.
+ */
+unsigned int waitingTimeOf(SimulationContext &context, const PcbEntry &process) {
+    return process.waitingTime + (process.state == STATE_READY ? context.timestamp - process.stateTime : 0);
+}
+
+/**
+ * Gets the time a process has spent blocked, including its current stay in the blocked queue.
+ */
+unsigned int blockedTimeOf(SimulationContext &context, const PcbEntry &process) {
+    return process.blockedTime + (process.state == STATE_BLOCKED ? context.timestamp - process.stateTime : 0);
+}
+
+/**
+ * Prints the scheduling metrics of a process for the P command. The times include the
+ * current stay in the ready or blocked queue.
+ * @param process the PCB entry of the process
+ */
+void printProcessMetrics(SimulationContext &context, const PcbEntry &process) {
+    *context.output << "   Process Waiting Time: " << waitingTimeOf(context, process) << endl;
+    *context.output << "   Process Blocked Time: " << blockedTimeOf(context, process) << endl;
+    *context.output << "   Process Response Time: ";
+    if (process.firstRunTime >= 0) {
+        *context.output << process.firstRunTime - process.startTime << endl;
+    }
+    else {
+        *context.output << "-" << endl;
+    }
+    *context.output << "   Process Context Switches: " << process.numContextSwitches << endl;
+}
+
+/**
+ * Gets the process ID of the process in a PCB slot.
+ * @param index the index of the PCB entry, or -1 for none
+ * @return the process ID, or -1 for none
+ */
+inline int processIdOf(const SimulationContext &context, int index) {
+    return index == -1 ? -1 : context.pcbTable[index].processId;
+}
+
+/**
+ * Implements the P command.
+*/
+void print(SimulationContext &context) {
+    //cout << "Print command is not implemented until iLab 3" << endl;
+    *context.output << "" <<endl;
+    *context.output << "***************************************************" << endl;
+    *context.output << "The Current System State: \n";
+
+    *context.output << "CURRENT TIME: " << context.timestamp << endl;
+
+    if (!context.cpus.empty()) {
+        *context.output << "Current Running State(s):";
+        for (size_t i = 0; i < context.cpus.size(); ++i) {
+            *context.output << " CPU " << i << "=" << processIdOf(context, context.cpus[i].runningState);
+        }
+        *context.output << endl;
+    }
+    else if (context.runningState != -1) {
+        *context.output << "Current Running State(s): " << processIdOf(context, context.runningState) << endl;
+    } 
+    else {
+        *context.output << "No State Running!" << endl;
+    }
+
+    *context.output << "-------------------------------" << endl;
+
+    *context.output << "Process(es) in Ready Queue" << endl;
+    vector<int> readyProcesses;
+    if (!context.cpus.empty()) {
+        for (size_t i = 0; i < context.cpus.size(); ++i) {
+            context.cpus[i].scheduler->listReady(readyProcesses);
+            for (int process: readyProcesses){
+                *context.output << processIdOf(context, process) << " (CPU " << i << ")" << endl;
+            }
+        }
+    }
+    else {
+        context.scheduler->listReady(readyProcesses);
+        for (int process: readyProcesses){
+            *context.output << processIdOf(context, process) << endl;
+        }
+    }
+
+    *context.output << "-------------------------------" << endl;
+
+    *context.output << "Process(es) in Blocked Queue" << endl;
+    for (int process: context.blockedState) {
+        *context.output << processIdOf(context, process) << endl;
+    }
+
+    *context.output << "-------------------------------" << endl;
+    *context.output << "Process Table" << endl;
+    *context.output << "" <<endl;
+
+    for (const auto& each_process: context.pcbTable) {
+        if (each_process.processId >= 0) {
+            *context.output << "   PID: " << each_process.processId << endl;
+            *context.output << "   Parent PID: " << each_process.parentProcessId << endl;
+            *context.output << "   Process Program Counter: " << each_process.programCounter << endl;
+            *context.output << "   Process Value: " << each_process.value << endl;
+            *context.output << "   Process Priority: " << each_process.priority << endl;
+            *context.output << "   Process State: " << helper_converting_state(each_process.state) << endl;
+            
+            *context.output << "   Process Start: " << each_process.startTime << endl;
+            *context.output << "   Process timeUsed: " << each_process.timeUsed << endl;
+            printProcessMetrics(context, each_process);
+            *context.output << "........................" << endl;
+        }
+    }
+
+    *context.output << "***************************************************" << endl;
+}
+
+/**
+ * A transport that delivers commands to the process manager.
+ */
+class CommandSource {
+public:
+    virtual ~CommandSource() {}
+
+    /**
+     * Gets the next command.
+     * @param command set to the command character
+     * @param count set to the repeat count of the command (1 if none was given)
+     * @return false once no more commands will arrive
+     */
+    virtual bool next(char &command, unsigned int &count) = 0;
+};
+
+/**
+ * Reads commands from a file descriptor in large chunks instead of one read() per command.
+ * A command is a single character optionally followed by a decimal repeat count, so the
+ * batch frame "Q1000000" runs a million quanta. Whitespace between commands is ignored.
+ */
+class CommandReader : public CommandSource {
+public:
+    explicit CommandReader(int fileDescriptor)
+        : fileDescriptor(fileDescriptor), begin(0), end(0) {}
+
+    /**
+     * Gets the next command from the stream.
+     * @param command set to the command character
+     * @param count set to the repeat count of the command (1 if none was given)
+     * @return false once the stream is exhausted or broken
+     */
+    bool next(char &command, unsigned int &count) override {
+        int ch;
+        do {
+            ch = get();
+            if (ch < 0) {
+                return false;
+            }
+        } while (isspace(ch));
+
+        command = (char) ch;
+        count = 0;
+        bool hasCount = false;
+        bool overflow = false;
+        while ((ch = peek()) >= 0 && isdigit(ch)) {
+            unsigned int digit = ch - '0';
+            overflow = overflow || count > (UINT_MAX - digit) / 10;
+            count = count * 10 + digit;
+            hasCount = true;
+            ++begin;
+        }
+
+        if (overflow) {
+            // A count that does not fit makes the whole command invalid.
+            command = MALFORMED_COMMAND;
+            count = 1;
+        }
+        else if (!hasCount) {
+            count = 1;
+        }
+        return true;
+    }
+
+private:
+    static const size_t BUFFER_SIZE = 64 * 1024;
+    // Stands in for a malformed command, which the process manager rejects as invalid.
+    static const char MALFORMED_COMMAND = '?';
+
+protected:
+    /**
+     * Reads the next chunk of the command stream into the buffer.
+     * @return the number of bytes read, 0 at the end of the stream or -1 on error
+     */
+    virtual ssize_t readChunk(char *chunk, size_t capacity) {
+        ssize_t numRead;
+        do {
+            numRead = read(fileDescriptor, chunk, capacity);
+        } while (numRead == -1 && errno == EINTR);
+        return numRead;
+    }
+
+private:
+    // Refills the buffer with a single chunk. Returns false on end of stream or error.
+    bool fill() {
+        ssize_t numRead = readChunk(buffer, BUFFER_SIZE);
+        begin = 0;
+        end = numRead > 0 ? numRead : 0;
+        return numRead > 0;
+    }
+
+    int peek() {
+        if (begin == end && !fill()) {
+            return -1;
+        }
+        return (unsigned char) buffer[begin];
+    }
+
+    int get() {
+        int ch = peek();
+        if (ch >= 0) {
+            ++begin;
+        }
+        return ch;
+    }
+
+    int fileDescriptor;
+    size_t begin;
+    size_t end;
+    char buffer[BUFFER_SIZE];
+};
+
+/**
+ * Writes the whole buffer to the file descriptor, retrying partial writes.
+ * @return false if the other end of the pipe is gone
+ */
+bool writeAll(int fileDescriptor, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t numWritten = write(fileDescriptor, data, length);
+        if (numWritten == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += numWritten;
+        length -= numWritten;
+    }
+    return true;
+}
+
+/**
+ * The buffered writer of the P command when its output is redirected (--print-output) or in
+ * a machine-readable format (--print-format). Everything is appended to one buffer that goes
+ * out in a single write at the end of each P command, or whenever it grows past 64 KiB. As a
+ * streambuf it also takes the text format through an ostream.
+ */
+class StateWriter : public streambuf {
+public:
+    StateWriter() : csvHeaderWritten(false), fileDescriptor(-1), ownsFileDescriptor(false) {}
+
+    ~StateWriter() {
+        flush();
+        if (ownsFileDescriptor) {
+            close(fileDescriptor);
+        }
+    }
+
+    /**
+     * Opens the target of the output.
+     * @param target "-" for stdout, "fd:<n>" for an inherited file descriptor (such as a pipe
+     *        or a socket), or else the path of a file to create
+     * @return false if the target cannot be opened
+     */
+    bool open(const string &target) {
+        if (target == "-") {
+            fileDescriptor = STDOUT_FILENO;
+            return true;
+        }
+        if (target.compare(0, 3, "fd:") == 0) {
+            char *end;
+            long number = strtol(target.c_str() + 3, &end, 10);
+            if (end == target.c_str() + 3 || *end != '\0' || number < 0
+                || fcntl(number, F_GETFD) == -1) {
+                errno = EBADF;
+                return false;
+            }
+            fileDescriptor = number;
+            return true;
+        }
+        fileDescriptor = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ownsFileDescriptor = fileDescriptor != -1;
+        return fileDescriptor != -1;
+    }
+
+    void append(const char *data, size_t length) {
+        buffer.append(data, length);
+        if (buffer.size() >= FLUSH_THRESHOLD) {
+            flush();
+        }
+    }
+
+    void append(const char *text) {
+        append(text, strlen(text));
+    }
+
+    void appendNumber(long long number) {
+        char digits[24];
+        char *end = to_chars(digits, digits + sizeof(digits), number).ptr;
+        append(digits, end - digits);
+    }
+
+    /**
+     * Writes out everything appended so far.
+     * @return false if the write failed
+     */
+    bool flush() {
+        bool written = buffer.empty() || writeAll(fileDescriptor, buffer.data(), buffer.size());
+        buffer.clear();
+        return written;
+    }
+
+    // Whether the CSV format has written its header row.
+    bool csvHeaderWritten;
+
+protected:
+    int_type overflow(int_type ch) override {
+        if (ch != traits_type::eof()) {
+            char character = traits_type::to_char_type(ch);
+            append(&character, 1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    streamsize xsputn(const char *data, streamsize length) override {
+        append(data, length);
+        return length;
+    }
+
+private:
+    static const size_t FLUSH_THRESHOLD = 64 * 1024;
+
+    int fileDescriptor;
+    bool ownsFileDescriptor;
+    string buffer;
+};
+
+// The fields of a live process in the machine-readable formats of the P command. The binary
+// format writes exactly this record, in host byte order.
+class StateProcessRecord {
+public:
+    int32_t processId;
+    int32_t parentProcessId;
+    int32_t programCounter;
+    int32_t value;
+    uint32_t priority;
+    uint32_t state;
+    uint32_t startTime;
+    uint32_t timeUsed;
+    uint32_t waitingTime;
+    uint32_t blockedTime;
+    // -1 if the process has not run yet.
+    int32_t responseTime;
+    uint32_t numContextSwitches;
+    int32_t cpu;
+};
+
+// A binary state dump starts with this header, followed by the process ID running on every
+// CPU (-1 if idle), the ready processes, the blocked processes (all int32_t process IDs) and
+// then a StateProcessRecord per live process. Dumps are simply concatenated.
+const char STATE_MAGIC[4] = {'P', 'M', 'S', 'T'};
+const uint32_t STATE_VERSION = 2;
+
+class StateDumpHeader {
+public:
+    char magic[4];
+    uint32_t version;
+    uint32_t timestamp;
+    uint32_t numCpus;
+    uint32_t numReady;
+    uint32_t numBlocked;
+    uint32_t numProcesses;
+};
+
+void appendJsonList(StateWriter &writer, const vector<int> &values) {
+    writer.append("[", 1);
+    for (size_t i = 0; i < values.size(); ++i) {
+        if (i > 0) {
+            writer.append(",", 1);
+        }
+        writer.appendNumber(values[i]);
+    }
+    writer.append("]", 1);
+}
+
+/**
+ * Writes the state as one JSON object on a line of its own.
+ */
+void writeJsonState(SimulationContext &context, const vector<int> &running, const vector<int> &ready,
+                    const vector<int> &blocked, const vector<StateProcessRecord> &processes) {
+    StateWriter &writer = *context.stateWriter;
+    writer.append("{\"time\":");
+    writer.appendNumber(context.timestamp);
+    writer.append(",\"running\":");
+    appendJsonList(writer, running);
+    writer.append(",\"ready\":");
+    appendJsonList(writer, ready);
+    writer.append(",\"blocked\":");
+    appendJsonList(writer, blocked);
+    writer.append(",\"processes\":[");
+    for (size_t i = 0; i < processes.size(); ++i) {
+        const StateProcessRecord &process = processes[i];
+        writer.append(i > 0 ? ",{\"pid\":" : "{\"pid\":");
+        writer.appendNumber(process.processId);
+        writer.append(",\"ppid\":");
+        writer.appendNumber(process.parentProcessId);
+        writer.append(",\"pc\":");
+        writer.appendNumber(process.programCounter);
+        writer.append(",\"value\":");
+        writer.appendNumber(process.value);
+        writer.append(",\"priority\":");
+        writer.appendNumber(process.priority);
+        writer.append(",\"state\":\"");
+        writer.append(helper_converting_state((State) process.state).c_str());
+        writer.append("\",\"start\":");
+        writer.appendNumber(process.startTime);
+        writer.append(",\"timeUsed\":");
+        writer.appendNumber(process.timeUsed);
+        writer.append(",\"waitingTime\":");
+        writer.appendNumber(process.waitingTime);
+        writer.append(",\"blockedTime\":");
+        writer.appendNumber(process.blockedTime);
+        writer.append(",\"responseTime\":");
+        if (process.responseTime >= 0) {
+            writer.appendNumber(process.responseTime);
+        }
+        else {
+            writer.append("null");
+        }
+        writer.append(",\"contextSwitches\":");
+        writer.appendNumber(process.numContextSwitches);
+        writer.append(",\"cpu\":");
+        writer.appendNumber(process.cpu);
+        writer.append("}", 1);
+    }
+    writer.append("]}\n");
+}
+
+/**
+ * Writes the state as CSV rows, one per live process, after a header row on the first dump.
+ */
+void writeCsvState(SimulationContext &context, const vector<StateProcessRecord> &processes) {
+    StateWriter &writer = *context.stateWriter;
+    if (!writer.csvHeaderWritten) {
+        writer.append("time,pid,ppid,pc,value,priority,state,start,time_used,waiting_time,"
+                      "blocked_time,response_time,context_switches,cpu\n");
+        writer.csvHeaderWritten = true;
+    }
+
+    for (const StateProcessRecord &process: processes) {
+        const long long fields[] = {process.processId, process.parentProcessId,
+                                    process.programCounter, process.value, process.priority};
+        writer.appendNumber(context.timestamp);
+        for (long long field: fields) {
+            writer.append(",", 1);
+            writer.appendNumber(field);
+        }
+        writer.append(",", 1);
+        writer.append(helper_converting_state((State) process.state).c_str());
+        const long long times[] = {process.startTime, process.timeUsed, process.waitingTime,
+                                   process.blockedTime};
+        for (long long field: times) {
+            writer.append(",", 1);
+            writer.appendNumber(field);
+        }
+        writer.append(",", 1);
+        if (process.responseTime >= 0) {
+            writer.appendNumber(process.responseTime);
+        }
+        writer.append(",", 1);
+        writer.appendNumber(process.numContextSwitches);
+        writer.append(",", 1);
+        writer.appendNumber(process.cpu);
+        writer.append("\n", 1);
+    }
+}
+
+/**
+ * Writes the state as a binary dump (see StateDumpHeader).
+ */
+void writeBinaryState(SimulationContext &context, const vector<int> &running, const vector<int> &ready,
+                      const vector<int> &blocked, const vector<StateProcessRecord> &processes) {
+    StateWriter &writer = *context.stateWriter;
+    StateDumpHeader header;
+    memcpy(header.magic, STATE_MAGIC, sizeof(header.magic));
+    header.version = STATE_VERSION;
+    header.timestamp = context.timestamp;
+    header.numCpus = running.size();
+    header.numReady = ready.size();
+    header.numBlocked = blocked.size();
+    header.numProcesses = processes.size();
+    writer.append(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    static_assert(sizeof(int) == sizeof(int32_t), "Process IDs are written as int32_t");
+    writer.append(reinterpret_cast<const char *>(running.data()), running.size() * sizeof(int32_t));
+    writer.append(reinterpret_cast<const char *>(ready.data()), ready.size() * sizeof(int32_t));
+    writer.append(reinterpret_cast<const char *>(blocked.data()), blocked.size() * sizeof(int32_t));
+    writer.append(reinterpret_cast<const char *>(processes.data()),
+                  processes.size() * sizeof(StateProcessRecord));
+}
+
+/**
+ * Implements the P command in the format selected with --print-format. Without a state writer
+ * the text format goes to the process manager's output, like its replies. The machine-readable
+ * formats only visit the live processes, through the list of live PCBs.
+ */
+void printState(SimulationContext &context) {
+    if (context.stateWriter == NULL) {
+        print(context);
+        return;
+    }
+    if (context.printFormat == PRINT_TEXT) {
+        ostream stream(context.stateWriter);
+        ostream *output = context.output;
+        context.output = &stream;
+        print(context);
+        context.output = output;
+        return;
+    }
+
+    // 1. Collect the running process of every CPU, the ready processes, CPU by CPU, and the
+    //    blocked ones, as process IDs.
+    vector<int> running;
+    vector<int> ready;
+    if (!context.cpus.empty()) {
+        vector<int> cpuReady;
+        for (const CpuContext &cpuContext: context.cpus) {
+            running.push_back(cpuContext.runningState);
+            cpuContext.scheduler->listReady(cpuReady);
+            ready.insert(ready.end(), cpuReady.begin(), cpuReady.end());
+        }
+    }
+    else {
+        running.push_back(context.runningState);
+        context.scheduler->listReady(ready);
+    }
+    vector<int> blocked(context.blockedState.begin(), context.blockedState.end());
+    for (vector<int> *processes: {&running, &ready, &blocked}) {
+        for (int &process: *processes) {
+            process = processIdOf(context, process);
+        }
+    }
+
+    // 2. Collect the live processes, in creation order.
+    vector<StateProcessRecord> processes;
+    processes.reserve(context.pcbTable.size() - context.freePcbSlots.size());
+    for (int i = context.firstLivePcb; i != -1; i = context.pcbTable[i].nextLive) {
+        const PcbEntry &entry = context.pcbTable[i];
+        StateProcessRecord record = {entry.processId, entry.parentProcessId,
+                                     (int32_t) entry.programCounter, entry.value, entry.priority,
+                                     entry.state, entry.startTime, entry.timeUsed,
+                                     waitingTimeOf(context, entry), blockedTimeOf(context, entry),
+                                     entry.firstRunTime >= 0 ? entry.firstRunTime - (int32_t) entry.startTime : -1,
+                                     entry.numContextSwitches, entry.lastCpu};
+        processes.push_back(record);
+    }
+
+    // 3. Write them in the selected format.
+    switch (context.printFormat) {
+        case PRINT_JSONL:
+            writeJsonState(context, running, ready, blocked, processes);
+            break;
+        case PRINT_CSV:
+            writeCsvState(context, processes);
+            break;
+        default:
+            writeBinaryState(context, running, ready, blocked, processes);
+            break;
+    }
+}
+
+/**
+ * In-process transport for several command producers (load generators, fault injectors, ...)
+ * feeding one process manager. Producers push into a bounded lock-free ring (Vyukov's
+ * multi-producer queue: every slot carries a sequence number that tells producers and the
+ * consumer whose turn it is), so they never block each other on a lock or a pipe.
+ *
+ * Every command is tagged with its producer and a per-producer sequence number. The consumer
+ * does not deliver commands in ring order, which depends on thread timing, but merges the
+ * producers round-robin: sequence 0 of every producer in producer order, then sequence 1, and
+ * so on, skipping producers that have closed. The manager thus sees the same command order
+ * on every run. Once every producer has closed, the consumer delivers a final 'T'.
+ */
+class MpscCommandQueue : public CommandSource {
+public:
+    /**
+     * @param numProducers the number of producers, identified as 0 to numProducers - 1
+     * @param capacity the number of slots of the ring, rounded up to a power of two
+     */
+    MpscCommandQueue(unsigned int numProducers, size_t capacity)
+        : producers(numProducers), pending(numProducers), numOpenProducers(numProducers),
+          nextProducer(0), enqueuePosition(0), dequeuePosition(0) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots = vector<Slot>(size);
+        for (size_t i = 0; i < size; ++i) {
+            slots[i].sequence.store(i, memory_order_relaxed);
+        }
+        mask = size - 1;
+        maxOutstanding = max<size_t>(1, size / numProducers);
+    }
+
+    /**
+     * Sends a command (producer side). Each producer must only be used by one thread.
+     * @param producer the index of the producer
+     * @param command the command character
+     * @param count the repeat count of the command
+     */
+    void push(unsigned int producer, char command, unsigned int count) {
+        QueuedCommand queued;
+        queued.producer = producer;
+        queued.sequence = producers[producer].nextSequence++;
+        queued.command = command;
+        queued.count = count;
+
+        // Spin (yielding) while the producer is too far ahead of the consumer, so the commands
+        // the consumer buffers for it stay bounded, then while the ring is full.
+        while (queued.sequence - producers[producer].numDelivered.load(memory_order_acquire)
+               >= maxOutstanding) {
+            this_thread::yield();
+        }
+        while (!tryPush(queued)) {
+            this_thread::yield();
+        }
+    }
+
+    // Tells the consumer that a producer will not send any more commands (producer side).
+    void close(unsigned int producer) {
+        push(producer, CLOSE_COMMAND, 0);
+    }
+
+    // Consumer side: delivers the commands in producer round-robin order.
+    bool next(char &command, unsigned int &count) override {
+        unsigned int numProducers = producers.size();
+        while (numOpenProducers > 0) {
+            // Skip producers that have closed.
+            if (producers[nextProducer].closed) {
+                nextProducer = (nextProducer + 1) % numProducers;
+                continue;
+            }
+
+            // Wait for the next command of the producer whose turn it is, buffering the
+            // commands of the other producers that arrive meanwhile.
+            while (pending[nextProducer].empty()) {
+                QueuedCommand queued;
+                if (!tryPop(queued)) {
+                    this_thread::yield();
+                    continue;
+                }
+
+                // A producer's commands enter the ring in order, so they leave it in order.
+                ProducerState &state = producers[queued.producer];
+                assert(queued.sequence == state.expectedSequence);
+                state.expectedSequence++;
+                pending[queued.producer].push_back(queued);
+            }
+
+            QueuedCommand queued = pending[nextProducer].front();
+            pending[nextProducer].pop_front();
+            producers[nextProducer].numDelivered.store(queued.sequence + 1, memory_order_release);
+            nextProducer = (nextProducer + 1) % numProducers;
+
+            if (queued.command == CLOSE_COMMAND) {
+                producers[queued.producer].closed = true;
+                numOpenProducers--;
+                continue;
+            }
+            command = queued.command;
+            count = queued.count;
+            return true;
+        }
+
+        if (finished) {
+            return false;
+        }
+        finished = true;
+        command = 'T';
+        count = 1;
+        return true;
+    }
+
+private:
+    // Marks the last command of a producer.
+    static const char CLOSE_COMMAND = 0;
+
+    class QueuedCommand {
+    public:
+        unsigned int producer;
+        unsigned long long sequence;
+        char command;
+        unsigned int count;
+    };
+
+    class Slot {
+    public:
+        atomic<size_t> sequence;
+        QueuedCommand command;
+    };
+
+    // Each producer's counter sits on its own cache line, so producers don't share lines.
+    class alignas(64) ProducerState {
+    public:
+        unsigned long long nextSequence = 0;  // Producer side.
+        unsigned long long expectedSequence = 0;  // Consumer side.
+        atomic<unsigned long long> numDelivered{0};  // Written by the consumer.
+        bool closed = false;  // Consumer side.
+    };
+
+    bool tryPush(const QueuedCommand &queued) {
+        size_t position = enqueuePosition.load(memory_order_relaxed);
+        Slot *slot;
+        for (;;) {
+            slot = &slots[position & mask];
+            size_t sequence = slot->sequence.load(memory_order_acquire);
+            intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+            if (difference == 0) {
+                if (enqueuePosition.compare_exchange_weak(position, position + 1,
+                                                          memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (difference < 0) {
+                return false;
+            }
+            else {
+                position = enqueuePosition.load(memory_order_relaxed);
+            }
+        }
+
+        slot->command = queued;
+        slot->sequence.store(position + 1, memory_order_release);
+        return true;
+    }
+
+    bool tryPop(QueuedCommand &queued) {
+        Slot &slot = slots[dequeuePosition & mask];
+        if (slot.sequence.load(memory_order_acquire) != dequeuePosition + 1) {
+            return false;
+        }
+
+        queued = slot.command;
+        slot.sequence.store(dequeuePosition + mask + 1, memory_order_release);
+        ++dequeuePosition;
+        return true;
+    }
+
+    vector<Slot> slots;
+    size_t mask;
+    // The most commands a producer may have pushed but not yet delivered, which bounds its
+    // pending queue: the producer's share of the ring, but at least one.
+    size_t maxOutstanding;
+    vector<ProducerState> producers;
+    vector<deque<QueuedCommand>> pending;
+    unsigned int numOpenProducers;
+    unsigned int nextProducer;
+    bool finished = false;
+    alignas(64) atomic<size_t> enqueuePosition;
+    alignas(64) size_t dequeuePosition;
+};
+
+// Trace files start with this magic, followed by the format version and the configuration
+// of the run, all as varints. Then come the records: a tag byte, 0 for a command (the command
+// character and its count) or 1 + the event type for an event (the time since the previous
+// event, the CPU and both arguments, zigzag encoded).
+const char TRACE_MAGIC[8] = {'P', 'M', 'T', 'R', 'A', 'C', 'E', 0};
+const uint64_t TRACE_VERSION = 1;
+
+// Maps signed values to unsigned ones, so small negative values also get short varints.
+inline uint32_t zigzagEncode(int32_t value) {
+    return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+inline int32_t zigzagDecode(uint32_t value) {
+    return (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+}
+
+/**
+ * Records the commands and events of a run into a trace file (--record).
+ */
+class TraceWriter : public TraceObserver {
+public:
+    /**
+     * Creates the trace file and writes its header with the configuration of a simulation.
+     * @return false if the file could not be created
+     */
+    bool open(const SimulationContext &context, const string &path) {
+        fileDescriptor = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fileDescriptor == -1) {
+            return false;
+        }
+        buffer.insert(buffer.end(), TRACE_MAGIC, TRACE_MAGIC + sizeof(TRACE_MAGIC));
+        putVarint(TRACE_VERSION);
+        putVarint(context.timeSliceLength);
+        putVarint(context.schedulerPolicy);
+        putVarint(context.agingInterval);
+        putVarint(context.randomSeed);
+        putVarint(context.numCpus);
+        return true;
+    }
+
+    void onCommand(char command, unsigned int count) override {
+        buffer.push_back(0);
+        buffer.push_back(command);
+        putVarint(count);
+        writeIfFull();
+    }
+
+    void onEvent(const LogEvent &event) override {
+        buffer.push_back(1 + event.type);
+        putVarint(event.time - lastTime);
+        putVarint(zigzagEncode(event.cpu));
+        putVarint(zigzagEncode(event.arg));
+        putVarint(zigzagEncode(event.arg2));
+        lastTime = event.time;
+        writeIfFull();
+    }
+
+    void finish() override {
+        if (fileDescriptor != -1) {
+            writeAll(fileDescriptor, buffer.data(), buffer.size());
+            buffer.clear();
+            close(fileDescriptor);
+            fileDescriptor = -1;
+        }
+    }
+
+private:
+    static const size_t WRITE_SIZE = 1024 * 1024;
+
+    void putVarint(uint64_t value) {
+        while (value >= 0x80) {
+            buffer.push_back((char) (value | 0x80));
+            value >>= 7;
+        }
+        buffer.push_back((char) value);
+    }
+
+    void writeIfFull() {
+        if (buffer.size() >= WRITE_SIZE) {
+            writeAll(fileDescriptor, buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+
+    int fileDescriptor = -1;
+    vector<char> buffer;
+    uint32_t lastTime = 0;
+};
+
+/**
+ * Replays a trace file (--replay). It is the command source of the process manager and
+ * checks every event of the replay against the next event of the trace, so it finds the
+ * first point where the simulation is no longer deterministic. With a stop time, the replay
+ * runs silently up to that time and then prints the system state.
+ */
+class TraceReplayer : public CommandSource, public TraceObserver {
+public:
+    explicit TraceReplayer(SimulationContext &context) : context(context) {}
+
+    /**
+     * Opens the trace file and applies the configuration from its header.
+     * @return false (after printing why) if the file is not a usable trace
+     */
+    bool open(const string &path) {
+        fileDescriptor = ::open(path.c_str(), O_RDONLY);
+        if (fileDescriptor == -1) {
+            cout << "Error opening trace " << path << ": " << strerror(errno) << endl;
+            return false;
+        }
+
+        char magic[sizeof(TRACE_MAGIC)];
+        uint64_t version, timeSlice, policy, aging, seed, cpuCount;
+        bool valid = true;
+        for (size_t i = 0; i < sizeof(magic) && valid; ++i) {
+            int ch = getByte();
+            valid = ch == TRACE_MAGIC[i];
+        }
+        valid = valid && getVarint(version) && version == TRACE_VERSION && getVarint(timeSlice)
+                && getVarint(policy) && policy < NUM_SCHEDULER_POLICIES && getVarint(aging)
+                && getVarint(seed) && getVarint(cpuCount) && timeSlice > 0 && cpuCount > 0;
+        if (!valid) {
+            cout << path << " is not a trace of this simulator version" << endl;
+            return false;
+        }
+
+        context.timeSliceLength = timeSlice;
+        context.schedulerPolicy = (SchedulerPolicy) policy;
+        context.agingInterval = aging;
+        context.randomSeed = seed;
+        context.numCpus = cpuCount;
+        return true;
+    }
+
+    ~TraceReplayer() {
+        if (fileDescriptor != -1) {
+            close(fileDescriptor);
+        }
+    }
+
+    /**
+     * Makes the replay stop at a simulated time and print the system state there. The replies
+     * to the commands before that are discarded.
+     */
+    void stopAt(unsigned int time) {
+        hasStopTime = true;
+        stopTime = time;
+        finalOutput = context.output;
+        finalStateWriter = context.stateWriter;
+        context.output = &discardedOutput;
+        context.stateWriter = NULL;
+    }
+
+    bool next(char &command, unsigned int &count) override {
+        if (!divergence.empty()) {
+            return false;
+        }
+
+        // Once the stop time is reached, print the state and terminate.
+        if (hasStopTime && context.timestamp >= stopTime) {
+            context.output = finalOutput;
+            context.stateWriter = finalStateWriter;
+            command = stopped ? 'T' : 'P';
+            count = 1;
+            stopped = true;
+            return true;
+        }
+
+        int tag = getByte();
+        if (tag == -1) {
+            return false;
+        }
+        int ch = getByte();
+        uint64_t value;
+        if (tag != 0 || ch == -1 || !getVarint(value)) {
+            diverge(tag == -1 ? "a truncated command" : "an event");
+            return false;
+        }
+        numCommands++;
+        command = (char) ch;
+        count = value;
+        // The time is below the stop time here, so the difference cannot wrap around.
+        if (hasStopTime && command == 'Q' && count > stopTime - context.timestamp) {
+            count = stopTime - context.timestamp;
+        }
+        return true;
+    }
+
+    void onCommand(char, unsigned int) override {}
+
+    void onEvent(const LogEvent &event) override {
+        if (!divergence.empty()) {
+            return;
+        }
+
+        int tag = getByte();
+        uint64_t timeDelta, cpuIndex, arg, arg2;
+        if (tag <= 0 || !getVarint(timeDelta) || !getVarint(cpuIndex) || !getVarint(arg)
+                || !getVarint(arg2)) {
+            diverge(tag == -1 ? "no more events" : "a command");
+            return;
+        }
+        if (tag - 1 > EVENT_REPLACE_FAILED) {
+            diverge("an unknown record");
+            return;
+        }
+
+        LogEvent expected = {(EventType) (tag - 1), zigzagDecode(cpuIndex),
+                             (uint32_t) (lastTime + timeDelta), zigzagDecode(arg),
+                             zigzagDecode(arg2), NULL};
+        lastTime = expected.time;
+        if (expected.type != event.type || expected.time != event.time
+                || expected.cpu != event.cpu || expected.arg != event.arg
+                || expected.arg2 != event.arg2) {
+            diverge(describe(expected) + ", the replay has " + describe(event));
+            return;
+        }
+        numEvents++;
+    }
+
+    void finish() override {}
+
+    // A description of the first difference between the trace and the replay, empty if none.
+    const string &getDivergence() const {
+        return divergence;
+    }
+
+    unsigned long long getNumCommands() const {
+        return numCommands;
+    }
+
+    unsigned long long getNumEvents() const {
+        return numEvents;
+    }
+
+private:
+    static const size_t BUFFER_SIZE = 1024 * 1024;
+
+    void diverge(const string &traceContent) {
+        divergence = "the replay diverged after " + to_string(numCommands) + " commands and "
+                     + to_string(numEvents) + " events at time " + to_string(context.timestamp)
+                     + ": the trace has " + traceContent;
+    }
+
+    static string describe(const LogEvent &event) {
+        static const char *const names[] = {
+            "quantum", "idle", "end of program", "set", "add", "decrement", "run", "preempt",
+            "steal", "block", "unblock", "end", "fork", "replace", "replace failed"
+        };
+        return string(names[event.type]) + " event (time " + to_string(event.time) + ", cpu "
+               + to_string(event.cpu) + ", arguments " + to_string(event.arg) + " "
+               + to_string(event.arg2) + ")";
+    }
+
+    int getByte() {
+        if (begin == end) {
+            ssize_t numRead;
+            do {
+                numRead = read(fileDescriptor, buffer.get(), BUFFER_SIZE);
+            } while (numRead == -1 && errno == EINTR);
+            if (numRead <= 0) {
+                return -1;
+            }
+            begin = 0;
+            end = numRead;
+        }
+        return (unsigned char) buffer[begin++];
+    }
+
+    bool getVarint(uint64_t &value) {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            int ch = getByte();
+            if (ch == -1) {
+                return false;
+            }
+            value |= (uint64_t) (ch & 0x7f) << shift;
+            if (ch < 0x80) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    SimulationContext &context;
+    int fileDescriptor = -1;
+    unique_ptr<char[]> buffer{new char[BUFFER_SIZE]};
+    size_t begin = 0;
+    size_t end = 0;
+    uint32_t lastTime = 0;
+    bool hasStopTime = false;
+    unsigned int stopTime = 0;
+    bool stopped = false;
+    // Where the replies go once the stop time is reached, and where they go before that.
+    ostream *finalOutput = NULL;
+    StateWriter *finalStateWriter = NULL;
+    ostream discardedOutput{NULL};
+    unsigned long long numCommands = 0;
+    unsigned long long numEvents = 0;
+    string divergence;
+};
+
+/**
+ * Single-producer/single-consumer byte ring in shared memory, carrying the same command text
+ * as the pipe from the commander to the process manager. Positions are free-running byte
+ * counts, so a side only makes a system call when it has to sleep (the reader on an empty
+ * ring, the writer on a full one) or to wake up a side that announced it is sleeping.
+ * While both sides keep up, commands cross without entering the kernel.
+ */
+class ShmCommandRing {
+public:
+    static const uint32_t CAPACITY = 64 * 1024;
+
+    /**
+     * Creates a ring in a new POSIX shared-memory object. The object is unlinked right away:
+     * processes forked afterwards inherit the mapping.
+     * @return the ring, or NULL if it could not be created
+     */
+    static ShmCommandRing *create() {
+        string name = "/process-manager-" + to_string(getpid());
+        int fileDescriptor = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fileDescriptor == -1) {
+            return NULL;
+        }
+        shm_unlink(name.c_str());
+
+        void *memory = MAP_FAILED;
+        if (ftruncate(fileDescriptor, sizeof(ShmCommandRing)) == 0) {
+            memory = mmap(NULL, sizeof(ShmCommandRing), PROT_READ | PROT_WRITE, MAP_SHARED,
+                          fileDescriptor, 0);
+        }
+        close(fileDescriptor);
+        if (memory == MAP_FAILED) {
+            return NULL;
+        }
+        // The new object is zero-filled, which is the empty, open state of the ring.
+        return static_cast<ShmCommandRing *>(memory);
+    }
+
+    /**
+     * Writes bytes into the ring (producer side), sleeping while the ring is full.
+     * @return false if the reader has gone away
+     */
+    bool write(const char *data, size_t length) {
+        while (length > 0) {
+            uint32_t position = writePosition.load(memory_order_relaxed);
+            uint32_t readAt = readPosition.load(memory_order_acquire);
+            uint32_t space = CAPACITY - (position - readAt);
+            if (readerClosed.load(memory_order_acquire)) {
+                return false;
+            }
+            if (space == 0) {
+                writerWaiting.store(1);
+                if (readPosition.load() == readAt && !readerClosed.load()) {
+                    futexWait(&readPosition, readAt, &WAIT_TIMEOUT);
+                }
+                writerWaiting.store(0);
+                continue;
+            }
+
+            uint32_t numBytes = min<size_t>(space, length);
+            for (uint32_t i = 0; i < numBytes; ++i) {
+                buffer[(position + i) & (CAPACITY - 1)] = data[i];
+            }
+            writePosition.store(position + numBytes);
+            if (readerWaiting.load()) {
+                futexWake(&writePosition);
+            }
+            data += numBytes;
+            length -= numBytes;
+        }
+        return true;
+    }
+
+    /**
+     * Reads the available bytes from the ring (consumer side), sleeping while it is empty.
+     * @return the number of bytes read, or 0 once the writer has closed the ring
+     */
+    size_t read(char *chunk, size_t capacity) {
+        for (;;) {
+            uint32_t position = readPosition.load(memory_order_relaxed);
+            uint32_t written = writePosition.load(memory_order_acquire);
+            if (written != position) {
+                uint32_t numBytes = min<size_t>(written - position, capacity);
+                for (uint32_t i = 0; i < numBytes; ++i) {
+                    chunk[i] = buffer[(position + i) & (CAPACITY - 1)];
+                }
+                readPosition.store(position + numBytes);
+                if (writerWaiting.load()) {
+                    futexWake(&readPosition);
+                }
+                return numBytes;
+            }
+
+            if (writerClosed.load(memory_order_acquire)) {
+                // Bytes written just before closing are picked up by one more pass.
+                if (writePosition.load(memory_order_acquire) == position) {
+                    return 0;
+                }
+                continue;
+            }
+
+            readerWaiting.store(1);
+            if (writePosition.load() == position && !writerClosed.load()) {
+                futexWait(&writePosition, position, &WAIT_TIMEOUT);
+            }
+            readerWaiting.store(0);
+        }
+    }
+
+    // Tells the reader that no more bytes will be written.
+    void closeWriter() {
+        writerClosed.store(1);
+        futexWake(&writePosition);
+    }
+
+    // Tells the writer that nothing will be read any more.
+    void closeReader() {
+        readerClosed.store(1);
+        futexWake(&readPosition);
+    }
+
+private:
+    // Sleeps are bounded so that a side notices when the other one closes without a wake-up.
+    static const struct timespec WAIT_TIMEOUT;
+
+    // The flags are written with sequentially consistent stores: a side sets its waiting flag
+    // and then re-checks the position, while the other side moves the position and then
+    // checks the flag, so at least one of them sees the other's write.
+    alignas(64) atomic<uint32_t> writePosition;
+    atomic<uint32_t> writerWaiting;
+    atomic<uint32_t> writerClosed;
+    alignas(64) atomic<uint32_t> readPosition;
+    atomic<uint32_t> readerWaiting;
+    atomic<uint32_t> readerClosed;
+    alignas(64) char buffer[CAPACITY];
+};
+
+const struct timespec ShmCommandRing::WAIT_TIMEOUT = {0, 100 * 1000 * 1000};
+
+// Reads the commands from a shared-memory ring instead of a file descriptor.
+class ShmCommandReader : public CommandReader {
+public:
+    explicit ShmCommandReader(ShmCommandRing *ring) : CommandReader(-1), ring(ring) {}
+
+protected:
+    ssize_t readChunk(char *chunk, size_t capacity) override {
+        return ring->read(chunk, capacity);
+    }
+
+private:
+    ShmCommandRing *ring;
+};
+
+// Reads the commands from a script held in memory, so that the simulations of a sweep all
+// read one copy of the script.
+class MemoryCommandReader : public CommandReader {
+public:
+    explicit MemoryCommandReader(const string &script)
+        : CommandReader(-1), script(script), position(0) {}
+
+protected:
+    ssize_t readChunk(char *chunk, size_t capacity) override {
+        size_t numBytes = min(capacity, script.size() - position);
+        memcpy(chunk, script.data() + position, numBytes);
+        position += numBytes;
+        return numBytes;
+    }
+
+private:
+    const string &script;
+    size_t position;
+};
+
+// Checkpoint images start with this magic. The image is a header followed by arrays of
+// fixed-size records at 8-byte aligned offsets, so it can be mapped and read in place.
+const char CHECKPOINT_MAGIC[8] = {'P', 'M', 'C', 'H', 'E', 'C', 'K', 0};
+const uint32_t CHECKPOINT_VERSION = 5;
+
+// An array in a checkpoint image: its offset from the start of the image and its length.
+class ImageSection {
+public:
+    uint64_t offset;
+    uint64_t count;
+};
+
+// A string in the byte array of a checkpoint image.
+class ImageString {
+public:
+    uint64_t offset;
+    uint64_t length;
+};
+
+// A decoded program, as a range of the instruction array. Every program is stored once, no
+// matter how many PCBs and cache entries share it.
+class ImageProgram {
+public:
+    uint64_t firstInstruction;
+    uint64_t numInstructions;
+};
+
+class ImageCacheEntry {
+public:
+    ImageString path;
+    uint64_t device;
+    uint64_t inode;
+    int64_t size;
+    int64_t modifiedSeconds;
+    int64_t modifiedNanoseconds;
+    uint32_t program;
+    uint32_t reserved;
+};
+
+// A PCB slot. Free slots have the process ID -1 and the program -1.
+class ImagePcb {
+public:
+    int32_t processId;
+    int32_t parentProcessId;
+    int32_t program;
+    int32_t programCounter;
+    int32_t value;
+    uint32_t priority;
+    uint32_t state;
+    uint32_t startTime;
+    uint32_t timeUsed;
+    uint32_t stateTime;
+    uint32_t waitingTime;
+    uint32_t blockedTime;
+    int32_t firstRunTime;
+    uint32_t numContextSwitches;
+    int32_t lastCpu;
+    int32_t previousLive;
+    int32_t nextLive;
+};
+
+// A CPU with its scheduler: the ready processes (a range of the ready process array) in the
+// order they would run, plus the state of the policy they do not imply.
+class ImageCpu {
+public:
+    int32_t runningState;
+    int32_t programCounter;
+    int32_t value;
+    uint32_t timeSlice;
+    uint32_t timeSliceUsed;
+    uint32_t reserved;
+    ImageSection readyProcesses;
+    ImageString schedulerState;
+};
+
+class CheckpointHeader {
+public:
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t timeSlice;
+    uint32_t policy;
+    uint32_t agingInterval;
+    uint32_t seed;
+    uint32_t numCpus;
+    uint32_t timestamp;
+    int32_t firstLivePcb;
+    int32_t lastLivePcb;
+    int32_t nextProcessId;
+    uint32_t reserved;
+    double cumulativeTimeDiff;
+    int64_t numTerminatedProcesses;
+    RunStatistics stats;
+    SchedulingMetrics metrics;
+    ImageSection bytes;
+    ImageSection strings;
+    ImageSection instructions;
+    ImageSection programs;
+    ImageSection cacheEntries;
+    ImageSection pcbs;
+    ImageSection freeSlots;
+    ImageSection cpus;
+    ImageSection readyProcesses;
+    ImageSection blockedProcesses;
+};
+
+// Collects the arrays of a checkpoint image.
+class ImageBuilder {
+public:
+    ImageBuilder() : data(sizeof(CheckpointHeader), 0) {}
+
+    template <class T>
+    ImageSection append(const vector<T> &values) {
+        data.resize((data.size() + 7) & ~(size_t) 7, 0);
+        ImageSection section = {data.size(), values.size()};
+        const char *begin = reinterpret_cast<const char *>(values.data());
+        data.insert(data.end(), begin, begin + values.size() * sizeof(T));
+        return section;
+    }
+
+    vector<char> data;
+};
+
+// Program slots of the image, so that every shared program is stored once.
+class ImagePrograms {
+public:
+    int32_t indexOf(const vector<Instruction> *program) {
+        if (program == NULL) {
+            return -1;
+        }
+        unordered_map<const vector<Instruction> *, int32_t>::iterator found = indices.find(program);
+        if (found != indices.end()) {
+            return found->second;
+        }
+        ImageProgram record = {instructions.size(), program->size()};
+        instructions.insert(instructions.end(), program->begin(), program->end());
+        programs.push_back(record);
+        return indices[program] = programs.size() - 1;
+    }
+
+    vector<Instruction> instructions;
+    vector<ImageProgram> programs;
+
+private:
+    unordered_map<const vector<Instruction> *, int32_t> indices;
+};
+
+/**
+ * Adds a string to the byte array of an image.
+ */
+ImageString appendImageString(vector<char> &bytes, const string &value) {
+    ImageString record = {bytes.size(), value.size()};
+    bytes.insert(bytes.end(), value.begin(), value.end());
+    return record;
+}
+
+/**
+ * Adds a CPU and its ready processes to an image.
+ */
+void appendImageCpu(const Cpu &state, int running, const Scheduler &policy, vector<char> &bytes,
+                    vector<int32_t> &readyProcesses, vector<ImageCpu> &records) {
+    vector<int> ready;
+    policy.listReady(ready);
+    ImageCpu record = {running, state.programCounter, state.value, state.timeSlice,
+                       state.timeSliceUsed, 0, {readyProcesses.size(), ready.size()},
+                       appendImageString(bytes, policy.saveState())};
+    readyProcesses.insert(readyProcesses.end(), ready.begin(), ready.end());
+    records.push_back(record);
+}
+
+/**
+ * Writes the whole state of the simulation to a checkpoint image. The image is written to a
+ * temporary file that then replaces the old image, so a crash never leaves a partial image.
+ * @param path the path of the image
+ * @return false if the image could not be written
+ */
+bool saveCheckpoint(SimulationContext &context, const string &path) {
+    vector<char> bytes;
+    ImagePrograms programs;
+
+    vector<ImageString> strings;
+    for (size_t i = 0; i < internedStrings.size(); ++i) {
+        strings.push_back(appendImageString(bytes, internedStrings.lookup(i)));
+    }
+
+    vector<ImageCacheEntry> cacheEntries;
+    shared_lock<shared_mutex> cacheLock(programCacheMutex);
+    for (const pair<const string, ProgramCacheEntry> &cached: programCache) {
+        const ProgramCacheEntry &entry = cached.second;
+        ImageCacheEntry record = {appendImageString(bytes, cached.first), (uint64_t) entry.device,
+                                  (uint64_t) entry.inode, entry.size, entry.modifiedTime.tv_sec,
+                                  entry.modifiedTime.tv_nsec,
+                                  (uint32_t) programs.indexOf(entry.program.get()), 0};
+        cacheEntries.push_back(record);
+    }
+    cacheLock.unlock();
+
+    vector<ImagePcb> pcbs;
+    for (const PcbEntry &entry: context.pcbTable) {
+        ImagePcb record = {entry.processId, entry.parentProcessId,
+                           programs.indexOf(entry.program.get()), (int32_t) entry.programCounter,
+                           entry.value, entry.priority, entry.state, entry.startTime,
+                           entry.timeUsed, entry.stateTime, entry.waitingTime, entry.blockedTime,
+                           entry.firstRunTime, entry.numContextSwitches, entry.lastCpu,
+                           entry.previousLive, entry.nextLive};
+        pcbs.push_back(record);
+    }
+
+    vector<int32_t> readyProcesses;
+    vector<ImageCpu> cpuRecords;
+    if (context.cpus.empty()) {
+        appendImageCpu(context.cpu, context.runningState, *context.scheduler, bytes,
+                       readyProcesses, cpuRecords);
+    }
+    for (const CpuContext &cpuContext: context.cpus) {
+        appendImageCpu(cpuContext.cpu, cpuContext.runningState, *cpuContext.scheduler, bytes,
+                       readyProcesses, cpuRecords);
+    }
+
+    ImageBuilder image;
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.headerSize = sizeof(header);
+    header.timeSlice = context.timeSliceLength;
+    header.policy = context.schedulerPolicy;
+    header.agingInterval = context.agingInterval;
+    header.seed = context.randomSeed;
+    header.numCpus = cpuRecords.size();
+    header.timestamp = context.timestamp;
+    header.firstLivePcb = context.firstLivePcb;
+    header.lastLivePcb = context.lastLivePcb;
+    header.nextProcessId = context.nextProcessId;
+    header.cumulativeTimeDiff = context.cumulativeTimeDiff;
+    header.numTerminatedProcesses = context.numTerminatedProcesses;
+    header.stats = context.runStats;
+    header.metrics = context.metrics;
+    header.bytes = image.append(bytes);
+    header.strings = image.append(strings);
+    header.instructions = image.append(programs.instructions);
+    header.programs = image.append(programs.programs);
+    header.cacheEntries = image.append(cacheEntries);
+    header.pcbs = image.append(pcbs);
+    header.freeSlots = image.append(vector<int32_t>(context.freePcbSlots.begin(), context.freePcbSlots.end()));
+    header.cpus = image.append(cpuRecords);
+    header.readyProcesses = image.append(readyProcesses);
+    header.blockedProcesses = image.append(vector<int32_t>(context.blockedState.begin(), context.blockedState.end()));
+    memcpy(image.data.data(), &header, sizeof(header));
+
+    string temporaryPath = path + ".tmp";
+    int fileDescriptor = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fileDescriptor == -1) {
+        return false;
+    }
+    bool written = writeAll(fileDescriptor, image.data.data(), image.data.size());
+    written = close(fileDescriptor) == 0 && written;
+    return written && rename(temporaryPath.c_str(), path.c_str()) == 0;
+}
+
+// A checkpoint image mapped into memory, with bounds-checked access to its arrays.
+class MappedImage : public MappedFile {
+public:
+    // Gets an array of the image, or NULL if it lies outside the image.
+    template <class T>
+    const T *section(const ImageSection &section) const {
+        if (section.offset % alignof(T) != 0 || section.offset > size
+            || section.count > (size - section.offset) / sizeof(T)) {
+            return NULL;
+        }
+        return reinterpret_cast<const T *>(data + section.offset);
+    }
+};
+
+/**
+ * Restores the state of the simulation from a checkpoint image, replacing the init process.
+ * Programs are copied straight from the image instead of being parsed again, and the
+ * configuration of the checkpointed run (policy, time slice, CPUs) is restored with them.
+ * @param path the path of the image
+ * @return false (after printing why) if the image cannot be restored
+ */
+bool restoreCheckpoint(SimulationContext &context, const string &path) {
+    MappedImage image;
+    if (!image.map(path)) {
+        *context.output << "Error restoring checkpoint " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    const CheckpointHeader *header = image.size >= sizeof(CheckpointHeader)
+        ? reinterpret_cast<const CheckpointHeader *>(image.data) : NULL;
+    if (header == NULL || memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0
+        || header->version != CHECKPOINT_VERSION || header->headerSize != sizeof(CheckpointHeader)) {
+        *context.output << path << " is not a checkpoint of this simulator version" << endl;
+        return false;
+    }
+
+    const char *bytes = image.section<char>(header->bytes);
+    const ImageString *strings = image.section<ImageString>(header->strings);
+    const Instruction *instructions = image.section<Instruction>(header->instructions);
+    const ImageProgram *programRecords = image.section<ImageProgram>(header->programs);
+    const ImageCacheEntry *cacheEntries = image.section<ImageCacheEntry>(header->cacheEntries);
+    const ImagePcb *pcbs = image.section<ImagePcb>(header->pcbs);
+    const int32_t *freeSlots = image.section<int32_t>(header->freeSlots);
+    const ImageCpu *cpuRecords = image.section<ImageCpu>(header->cpus);
+    const int32_t *readyProcesses = image.section<int32_t>(header->readyProcesses);
+    const int32_t *blockedProcesses = image.section<int32_t>(header->blockedProcesses);
+    bool valid = bytes && strings && instructions && programRecords && cacheEntries && pcbs
+                 && freeSlots && cpuRecords && readyProcesses && blockedProcesses
+                 && header->policy < NUM_SCHEDULER_POLICIES && header->timeSlice > 0
+                 && header->numCpus == header->cpus.count && header->numCpus > 0;
+
+    // Every index stored in the image has to refer to an entry of the image.
+    size_t numPcbs = header->pcbs.count;
+    size_t numPrograms = header->programs.count;
+    auto validString = [&](const ImageString &value) {
+        return value.offset <= header->bytes.count
+            && value.length <= header->bytes.count - value.offset;
+    };
+    auto validProcess = [&](int32_t process) {
+        return process >= 0 && (size_t) process < numPcbs && pcbs[process].program >= 0;
+    };
+    for (size_t i = 0; valid && i < header->strings.count; ++i) {
+        valid = validString(strings[i]);
+    }
+    for (size_t i = 0; valid && i < numPrograms; ++i) {
+        valid = programRecords[i].firstInstruction <= header->instructions.count
+                && programRecords[i].numInstructions
+                   <= header->instructions.count - programRecords[i].firstInstruction;
+    }
+    for (size_t i = 0; valid && i < header->instructions.count; ++i) {
+        valid = instructions[i].operation != 'R'
+                || (instructions[i].intArg >= 0
+                    && (size_t) instructions[i].intArg < header->strings.count);
+    }
+    for (size_t i = 0; valid && i < header->cacheEntries.count; ++i) {
+        valid = validString(cacheEntries[i].path) && cacheEntries[i].program < numPrograms;
+    }
+    for (size_t i = 0; valid && i < numPcbs; ++i) {
+        valid = pcbs[i].program >= -1 && pcbs[i].program < (int64_t) numPrograms
+                && pcbs[i].state <= STATE_BLOCKED
+                && (pcbs[i].program == -1
+                    || (pcbs[i].lastCpu >= 0 && (uint32_t) pcbs[i].lastCpu < header->numCpus
+                        && pcbs[i].processId >= 0
+                        && pcbs[i].processId < header->nextProcessId));
+    }
+    // The list of live processes has to link every live process exactly once.
+    size_t numLive = 0;
+    for (size_t i = 0; valid && i < numPcbs; ++i) {
+        numLive += pcbs[i].program >= 0;
+    }
+    int32_t previous = -1;
+    int32_t next = header->firstLivePcb;
+    size_t numLinked = 0;
+    while (valid && next != -1) {
+        valid = validProcess(next) && pcbs[next].previousLive == previous && ++numLinked <= numLive;
+        if (valid) {
+            previous = next;
+            next = pcbs[next].nextLive;
+        }
+    }
+    valid = valid && previous == header->lastLivePcb && numLinked == numLive;
+
+    // Every slot has to be either free (once) or hold a live process that is in exactly one
+    // place matching its state: running on a CPU, ready on a CPU, or blocked.
+    vector<bool> placed(numPcbs);
+    size_t numPlaced = 0;
+    auto placeProcess = [&](int32_t process, State state) {
+        if (!validProcess(process) || placed[process] || pcbs[process].state != state) {
+            return false;
+        }
+        placed[process] = true;
+        ++numPlaced;
+        return true;
+    };
+    for (size_t i = 0; valid && i < header->freeSlots.count; ++i) {
+        valid = freeSlots[i] >= 0 && (size_t) freeSlots[i] < numPcbs
+                && pcbs[freeSlots[i]].program == -1 && !placed[freeSlots[i]];
+        if (valid) {
+            placed[freeSlots[i]] = true;
+        }
+    }
+    valid = valid && header->freeSlots.count == numPcbs - numLive;
+    for (size_t i = 0; valid && i < header->cpus.count; ++i) {
+        const ImageSection &ready = cpuRecords[i].readyProcesses;
+        valid = validString(cpuRecords[i].schedulerState)
+                && (cpuRecords[i].runningState == -1 || placeProcess(cpuRecords[i].runningState, STATE_RUNNING))
+                && ready.offset <= header->readyProcesses.count
+                && ready.count <= header->readyProcesses.count - ready.offset;
+        for (size_t j = 0; valid && j < ready.count; ++j) {
+            valid = placeProcess(readyProcesses[ready.offset + j], STATE_READY);
+        }
+    }
+    for (size_t i = 0; valid && i < header->blockedProcesses.count; ++i) {
+        valid = placeProcess(blockedProcesses[i], STATE_BLOCKED);
+    }
+    valid = valid && numPlaced == numLive;
+    if (!valid) {
+        *context.output << path << " is a damaged checkpoint" << endl;
+        return false;
+    }
+
+    // 1. Restore the configuration and the counters of the run.
+    context.timeSliceLength = header->timeSlice;
+    context.schedulerPolicy = (SchedulerPolicy) header->policy;
+    context.agingInterval = header->agingInterval;
+    context.randomSeed = header->seed;
+    context.numCpus = header->numCpus;
+    context.timestamp = header->timestamp;
+    context.cumulativeTimeDiff = header->cumulativeTimeDiff;
+    context.numTerminatedProcesses = header->numTerminatedProcesses;
+    context.runStats = header->stats;
+    context.metrics = header->metrics;
+
+    // 2. Add the filenames to the string table, then restore the programs, pointing their R
+    //    operations at the filenames' indices in this process, and the program cache.
+    vector<int32_t> stringIndices;
+    for (size_t i = 0; i < header->strings.count; ++i) {
+        stringIndices.push_back(
+            internedStrings.intern(string_view(bytes + strings[i].offset, strings[i].length)));
+    }
+    vector<ProgramPtr> programs;
+    for (size_t i = 0; i < numPrograms; ++i) {
+        const Instruction *first = instructions + programRecords[i].firstInstruction;
+        shared_ptr<vector<Instruction>> program = make_shared<vector<Instruction>>(
+            first, first + programRecords[i].numInstructions);
+        for (Instruction &instruction: *program) {
+            if (instruction.operation == 'R') {
+                instruction.intArg = stringIndices[instruction.intArg];
+            }
+        }
+        programs.push_back(program);
+    }
+    lock_guard<shared_mutex> cacheLock(programCacheMutex);
+    for (size_t i = 0; i < header->cacheEntries.count; ++i) {
+        const ImageCacheEntry &record = cacheEntries[i];
+        ProgramCacheEntry &entry =
+            programCache[string(bytes + record.path.offset, record.path.length)];
+        entry.device = record.device;
+        entry.inode = record.inode;
+        entry.size = record.size;
+        entry.modifiedTime.tv_sec = record.modifiedSeconds;
+        entry.modifiedTime.tv_nsec = record.modifiedNanoseconds;
+        entry.program = programs[record.program];
+    }
+
+    // 3. Restore the PCB table, the free slots and the blocked queue.
+    context.pcbTable.assign(numPcbs, PcbEntry());
+    for (size_t i = 0; i < numPcbs; ++i) {
+        PcbEntry &entry = context.pcbTable[i];
+        entry.processId = pcbs[i].processId;
+        entry.parentProcessId = pcbs[i].parentProcessId;
+        if (pcbs[i].program >= 0) {
+            entry.program = programs[pcbs[i].program];
+        }
+        entry.programCounter = pcbs[i].programCounter;
+        entry.value = pcbs[i].value;
+        entry.priority = pcbs[i].priority;
+        entry.state = (State) pcbs[i].state;
+        entry.startTime = pcbs[i].startTime;
+        entry.timeUsed = pcbs[i].timeUsed;
+        entry.stateTime = pcbs[i].stateTime;
+        entry.waitingTime = pcbs[i].waitingTime;
+        entry.blockedTime = pcbs[i].blockedTime;
+        entry.firstRunTime = pcbs[i].firstRunTime;
+        entry.numContextSwitches = pcbs[i].numContextSwitches;
+        entry.lastCpu = pcbs[i].lastCpu;
+        entry.previousLive = pcbs[i].previousLive;
+        entry.nextLive = pcbs[i].nextLive;
+    }
+    context.firstLivePcb = header->firstLivePcb;
+    context.lastLivePcb = header->lastLivePcb;
+    context.nextProcessId = header->nextProcessId;
+    context.freePcbSlots.assign(freeSlots, freeSlots + header->freeSlots.count);
+    context.blockedState.assign(blockedProcesses, blockedProcesses + header->blockedProcesses.count);
+
+    // 4. Restore the CPUs. Each scheduler gets its ready processes back in the order they
+    //    would run, then the rest of its state.
+    context.cpus.clear();
+    if (context.numCpus > 1) {
+        context.cpus.resize(context.numCpus);
+    }
+    for (size_t i = 0; i < context.numCpus; ++i) {
+        const ImageCpu &record = cpuRecords[i];
+        if (!context.cpus.empty()) {
+            bindCpu(context, i);
+        }
+        context.scheduler = createScheduler(context, context.schedulerPolicy, context.agingInterval,
+                                    context.cpus.empty() ? context.randomSeed : context.randomSeed + i);
+        for (size_t j = 0; j < record.readyProcesses.count; ++j) {
+            context.scheduler->enqueue(readyProcesses[record.readyProcesses.offset + j]);
+        }
+        context.scheduler->restoreState(string(bytes + record.schedulerState.offset,
+                                       record.schedulerState.length));
+        context.runningState = record.runningState;
+        context.cpu.pProgram = context.runningState == -1 ? NULL : context.pcbTable[context.runningState].program.get();
+        context.cpu.programCounter = record.programCounter;
+        context.cpu.value = record.value;
+        context.cpu.timeSlice = record.timeSlice;
+        context.cpu.timeSliceUsed = record.timeSliceUsed;
+        if (!context.cpus.empty()) {
+            unbindCpu(context);
+        }
+    }
+    if (!context.cpus.empty()) {
+        context.scheduler.reset();
+        context.runningState = -1;
+    }
+    return true;
+}
+
+/**
+ * Writes the checkpoint image (--checkpoint), if one was requested.
+ */
+void writeCheckpoint(SimulationContext &context) {
+    if (!context.checkpointPath.empty() && !saveCheckpoint(context, context.checkpointPath)) {
+        context.eventLog.flush();
+        *context.output << "Error writing checkpoint " << context.checkpointPath << ": " << strerror(errno) << endl;
+    }
+}
+
+/**
+ * Sets up a new simulation with the init process running the program in file.txt.
+ * @return false if the init program cannot be loaded
+ */
+bool startSimulation(SimulationContext &context) {
+    // Attempt to create the init process.
+    context.pcbTable.clear();
+    context.freePcbSlots.clear();
+    context.firstLivePcb = -1;
+    context.lastLivePcb = -1;
+    int initIndex = allocatePcb(context);
+    context.pcbTable[initIndex].program = loadProgram(context, "file.txt");
+    if (!context.pcbTable[initIndex].program) {
+        return false;
+    }
+
+    context.pcbTable[initIndex].processId = 0;
+    context.nextProcessId = 1;
+    context.pcbTable[initIndex].parentProcessId = -1;
+    context.pcbTable[initIndex].programCounter = 0;
+    context.pcbTable[initIndex].value = 0;
+    context.pcbTable[initIndex].priority = 0;
+    context.pcbTable[initIndex].state = STATE_RUNNING;
+    context.pcbTable[initIndex].startTime = 0;
+    context.pcbTable[initIndex].timeUsed = 0;
+    context.pcbTable[initIndex].stateTime = 0;
+    context.pcbTable[initIndex].waitingTime = 0;
+    context.pcbTable[initIndex].blockedTime = 0;
+    context.pcbTable[initIndex].firstRunTime = 0;
+    context.pcbTable[initIndex].numContextSwitches = 1;
+
+    context.runningState = initIndex;
+
+    context.cpu.pProgram = context.pcbTable[initIndex].program.get();
+    context.cpu.programCounter = context.pcbTable[initIndex].programCounter;
+    context.cpu.value = context.pcbTable[initIndex].value;
+    context.timestamp = 0;
+    context.blockedState.clear();
+    context.scheduler = createScheduler(context, context.schedulerPolicy, context.agingInterval, context.randomSeed);
+    context.cpu.timeSlice = context.scheduler->timeSliceFor(initIndex);
+    context.cpu.timeSliceUsed = 0;
+
+    // In SMP mode the init process starts on CPU 0 and the other CPUs start idle.
+    context.cpus.clear();
+    if (context.numCpus > 1) {
+        context.cpus.resize(context.numCpus);
+        for (size_t i = 1; i < context.cpus.size(); ++i) {
+            context.cpus[i].scheduler = createScheduler(context, context.schedulerPolicy, context.agingInterval, context.randomSeed + i);
+        }
+        context.boundCpu = 0;
+        unbindCpu(context);
+    }
+    context.runStats = RunStatistics();
+    context.runStats.numCreatedProcesses = 1;
+    context.metrics = SchedulingMetrics();
+    context.metrics.responseTimes.record(0);
+    return true;
+}
+
+/**
+ * Prints the percentiles of a latency histogram on one line.
+ */
+void printPercentiles(SimulationContext &context, const string &name, const LatencyHistogram &histogram) {
+    *context.output << name << " p50/p95/p99/max: " << histogram.percentile(50) << "/"
+                    << histogram.percentile(95) << "/" << histogram.percentile(99) << "/"
+                    << histogram.maxValue << endl;
+}
+
+/**
+ * Prints the scheduling metrics of the run when the process manager terminates.
+ */
+void printSchedulingMetrics(SimulationContext &context) {
+    const SchedulingMetrics &metrics = context.metrics;
+    if (context.numTerminatedProcesses > 0) {
+        *context.output << "Average Waiting Time: "
+                        << metrics.totalWaitingTime / context.numTerminatedProcesses << endl;
+        *context.output << "Average Blocked Time: "
+                        << metrics.totalBlockedTime / context.numTerminatedProcesses << endl;
+    }
+    if (metrics.responseTimes.numValues > 0) {
+        *context.output << "Average Response Time: "
+                        << metrics.totalResponseTime / metrics.responseTimes.numValues << endl;
+    }
+
+    // Utilization is the share of CPU quanta in which a process ran, and throughput the
+    // number of processes terminated per unit of simulated time.
+    if (context.timestamp > 0) {
+        double capacity = (double) context.timestamp * max(1u, context.numCpus);
+        *context.output << "CPU Utilization (%): "
+                        << 100 * (capacity - metrics.numIdleQuanta) / capacity << endl;
+        *context.output << "Throughput: " << (double) context.numTerminatedProcesses / context.timestamp
+                        << endl;
+    }
+    if (metrics.turnaroundTimes.numValues > 0) {
+        printPercentiles(context, "Turnaround Time", metrics.turnaroundTimes);
+        printPercentiles(context, "Waiting Time", metrics.waitingTimes);
+    }
+    printPercentiles(context, "Response Time", metrics.responseTimes);
+}
+
+// Function that implements the process manager.
+int runProcessManager(SimulationContext &context, CommandSource &source) {
+    // Start from the init process, or from a checkpoint (--restore).
+    bool started = context.restorePath.empty() ? startSimulation(context) : restoreCheckpoint(context, context.restorePath);
+    if (!started) {
+        return EXIT_FAILURE;
+    }
+
+    context.cpuThreadPool.reset();
+    if (context.numCpus > 1 && context.numCpuThreads > 1) {
+        context.cpuThreadPool.reset(new CpuThreadPool(min(context.numCpuThreads, context.numCpus)));
+    }
+    context.eventLog.start(context.logLevel);
+
+    // Loop until a 'T' is read, then terminate.
+    char ch;
+    unsigned int count;
+    do {
+        // Read a command (and its repeat count) from the pipe.
+        if (!source.next(ch, count)) {
+            // Assume the parent process exited, breaking the pipe.
+            break;
+        }
+
+        context.runStats.numCommands++;
+        if (context.traceObserver != NULL) {
+            context.traceObserver->onCommand(ch, count);
+        }
+        if (ch != 'Q') {
+            // The command prints directly, so the events before it have to go out first.
+            context.eventLog.flush();
+        }
+        switch (ch) {
+            case 'Q':
+                quantum(context, count);
+                context.runStats.numQuanta += count;
+                break;
+            case 'U':
+                *context.output << "You entered U" << endl;
+                for (unsigned int i = 0; i < count; ++i) {
+                    if (context.cpus.empty()) {
+                        unblock(context);
+                    }
+                    else if (!context.blockedState.empty()) {
+                        // The process goes back to the CPU it last ran on.
+                        bindCpu(context, context.pcbTable[context.blockedState.front()].lastCpu);
+                        unblock(context);
+                        unbindCpu(context);
+                    }
+                }
+                break;
+            case 'P':
+                *context.output << "You entered P" << endl;
+                for (unsigned int i = 0; i < count; ++i) {
+                    printState(context);
+                }
+                if (context.stateWriter != NULL) {
+                    context.output->flush();
+                    context.stateWriter->flush();
+                }
+                break;
+            case 'T':
+                *context.output << "Terminate!" << endl;
+                break;
+            default:
+                *context.output << "You entered an invalid character!" << endl;
+        }
+
+        // Instruction output is not flushed per line, so flush once per command.
+        context.output->flush();
+        context.eventLog.publish();
+
+        if (context.checkpointInterval > 0 && context.runStats.numCommands % context.checkpointInterval == 0) {
+            writeCheckpoint(context);
+        }
+    } while (ch != 'T');
+
+    context.eventLog.stop();
+    if (context.traceObserver != NULL) {
+        context.traceObserver->finish();
+    }
+    writeCheckpoint(context);
+
+    if (context.numTerminatedProcesses > 0) {
+		double avg_turn_ard_time = (context.cumulativeTimeDiff)/(context.numTerminatedProcesses);
+		*context.output << "Average Turnaround Time: " << avg_turn_ard_time << endl;
+	}
+	else {
+		*context.output << "Terminated with nothing!" << endl;
+	}
+    *context.output << "Context Switches: " << context.runStats.numContextSwitches << endl;
+    printSchedulingMetrics(context);
+    context.cpuThreadPool.reset();
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Looks up a scheduling policy by its command-line name.
+ * @param name the name of the policy
+ * @param policy set to the policy if the name is known
+ * @return false if the name is unknown
+ */
+bool parsePolicy(const string &name, SchedulerPolicy &policy) {
+    for (int i = 0; i < NUM_SCHEDULER_POLICIES; ++i) {
+        if (name == schedulerNames[i]) {
+            policy = (SchedulerPolicy) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Looks up a format of the P command by its command-line name.
+ * @param name the name of the format
+ * @param format set to the format if the name is known
+ * @return false if the name is unknown
+ */
+bool parsePrintFormat(const string &name, PrintFormat &format) {
+    static const char *const names[] = {"text", "jsonl", "csv", "binary"};
+    for (int i = 0; i <= PRINT_BINARY; ++i) {
+        if (name == names[i]) {
+            format = (PrintFormat) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Parses a comma-separated list of scheduling policies, or "all" for every policy.
+ * @param text the list
+ * @param policies set to the policies, in the order given
+ * @return false if a name is unknown
+ */
+bool parsePolicyList(const string &text, vector<SchedulerPolicy> &policies) {
+    policies.clear();
+    if (text == "all") {
+        for (int i = 0; i < NUM_SCHEDULER_POLICIES; ++i) {
+            policies.push_back((SchedulerPolicy) i);
+        }
+        return true;
+    }
+
+    stringstream stream(text);
+    string name;
+    while (getline(stream, name, ',')) {
+        SchedulerPolicy policy;
+        if (!parsePolicy(name, policy)) {
+            return false;
+        }
+        policies.push_back(policy);
+    }
+    return !policies.empty();
+}
+
+/**
+ * Parses a comma-separated list of positive counts, where an item can also be an inclusive
+ * range such as "1-8".
+ * @param text the list
+ * @param values set to the counts, in the order given
+ * @return false if an item is not a positive count or a range of them
+ */
+bool parseCountList(const string &text, vector<unsigned int> &values) {
+    values.clear();
+    stringstream stream(text);
+    string item;
+    while (getline(stream, item, ',')) {
+        if (item.empty() || !isdigit(item[0])) {
+            return false;
+        }
+        char *end;
+        unsigned long first = strtoul(item.c_str(), &end, 10);
+        unsigned long last = first;
+        if (*end == '-' && isdigit(end[1])) {
+            last = strtoul(end + 1, &end, 10);
+        }
+        if (*end != '\0' || first == 0 || last < first || last > 1000000) {
+            return false;
+        }
+        for (unsigned long value = first; value <= last; ++value) {
+            values.push_back(value);
+        }
+    }
+    return !values.empty();
+}
+
+/**
+ * Looks up a log level by its command-line name.
+ * @param name the name of the level
+ * @param level set to the level if the name is known
+ * @return false if the name is unknown
+ */
+bool parseLogLevel(const string &name, LogLevel &level) {
+    static const char *const names[] = {"off", "normal", "verbose"};
+    for (int i = 0; i <= LOG_VERBOSE; ++i) {
+        if (name == names[i]) {
+            level = (LogLevel) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Parses the command-line options.
+ * @param options the options to fill in
+ * @return false (after printing the usage) if the arguments are invalid
+ */
+bool parseOptions(int argc, char *argv[], SimulatorOptions &options) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--script" && i + 1 < argc) {
+            options.scriptPath = argv[++i];
+        }
+        else if (arg == "--time-slice" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            options.timeSlice = atoi(argv[++i]);
+        }
+        else if (arg == "--scheduler" && i + 1 < argc && parsePolicy(argv[i + 1], options.scheduler)) {
+            ++i;
+        }
+        else if (arg == "--aging-interval" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            options.agingInterval = atoi(argv[++i]);
+        }
+        else if (arg == "--seed" && i + 1 < argc) {
+            options.seed = strtoul(argv[++i], NULL, 10);
+        }
+        else if (arg == "--producer" && i + 1 < argc) {
+            options.producerScripts.push_back(argv[++i]);
+        }
+        else if (arg == "--transport" && i + 1 < argc
+                 && (string(argv[i + 1]) == "pipe" || string(argv[i + 1]) == "shm")) {
+            options.useSharedMemory = string(argv[++i]) == "shm";
+        }
+        else if (arg == "--log-level" && i + 1 < argc && parseLogLevel(argv[i + 1], options.logLevel)) {
+            ++i;
+        }
+        else if (arg == "--print-format" && i + 1 < argc && parsePrintFormat(argv[i + 1], options.printFormat)) {
+            ++i;
+        }
+        else if (arg == "--print-output" && i + 1 < argc) {
+            options.printOutput = argv[++i];
+        }
+        else if (arg == "--record" && i + 1 < argc) {
+            options.recordPath = argv[++i];
+        }
+        else if (arg == "--replay" && i + 1 < argc) {
+            options.replayPath = argv[++i];
+        }
+        else if (arg == "--until" && i + 1 < argc && atoll(argv[i + 1]) >= 0) {
+            options.replayUntil = atoll(argv[++i]);
+        }
+        else if (arg == "--checkpoint" && i + 1 < argc) {
+            options.checkpointPath = argv[++i];
         }
+        else if (arg == "--checkpoint-interval" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            options.checkpointInterval = atoi(argv[++i]);
+        }
+        else if (arg == "--restore" && i + 1 < argc) {
+            options.restorePath = argv[++i];
+        }
+        else if (arg == "--sweep" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            options.sweepCount = atoi(argv[++i]);
+        }
+        else if (arg == "--sweep-threads" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            options.sweepThreads = atoi(argv[++i]);
+        }
+        else if (arg == "--sweep-policies" && i + 1 < argc && parsePolicyList(argv[i + 1], options.sweepPolicies)) {
+            ++i;
+        }
+        else if (arg == "--sweep-time-slices" && i + 1 < argc && parseCountList(argv[i + 1], options.sweepTimeSlices)) {
+            ++i;
+        }
+        else if (arg == "--sweep-cpus" && i + 1 < argc && parseCountList(argv[i + 1], options.sweepCpuCounts)) {
+            ++i;
+        }
+        else if (arg == "--cpus" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            options.numCpus = atoi(argv[++i]);
+        }
+        else if (arg == "--cpu-threads" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            options.numCpuThreads = atoi(argv[++i]);
+        }
+        else {
+            cout << "Usage: " << argv[0] << " [--script <command file>|-]"
+                 << " [--producer <command file>]... [--transport pipe|shm] [--time-slice <quanta>]"
+                 << " [--scheduler fcfs|sjf|srtf|rr|priority|lottery|mlfq]"
+                 << " [--aging-interval <quanta>] [--seed <lottery seed>]"
+                 << " [--cpus <count>] [--cpu-threads <count>]"
+                 << " [--log-level off|normal|verbose] [--print-format text|jsonl|csv|binary]"
+                 << " [--print-output <file>|fd:<n>|-] [--record <trace file>]"
+                 << " [--replay <trace file> [--until <time>]]"
+                 << " [--checkpoint <image> [--checkpoint-interval <commands>]]"
+                 << " [--restore <image>] [--sweep <seeds>] [--sweep-policies <policy,...>|all]"
+                 << " [--sweep-time-slices <list>] [--sweep-cpus <list>] [--sweep-threads <count>]"
+                 << endl;
+            return false;
+        }
+    }
 
-        lineNum++;
+    // A trace only records the configuration of the run, so its replay starts from the init
+    // process and could not reproduce a run that started from a checkpoint.
+    if (!options.recordPath.empty() && !options.restorePath.empty()) {
+        cout << "--record cannot be used with --restore: replays start from the init process" << endl;
+        return false;
     }
-    
-    file.close();
     return true;
 }
 
 /**
- * Removes whitespace at the start and the end of the string
- * @param trimmed_str the string which needs to be trimmed.
- * @return the trimmed string without whitespaces at beginning and end of the string.
+ * Reads a whole file into memory.
+ * @param path the path of the file, "-" for stdin
+ * @param contents set to the contents of the file
+ * @return false if the file cannot be read
  */
-//string trim(string trimmed_str)
-//{
-//    int front = trimmed_str.find_first_not_of(' ');
-//    int rear = trimmed_str.find_last_not_of(' ');
-
-//    if (rear == -1 || front == -1) {
-//        return "";
-//    }
-
-//    return trimmed_str.substr(front, rear - front + 1);
-//}
+bool readFile(const string &path, string &contents) {
+    int fileDescriptor = path == "-" ? STDIN_FILENO : open(path.c_str(), O_RDONLY);
+    if (fileDescriptor == -1) {
+        return false;
+    }
 
-/**
- * Implements the S operation and 
- * Sets the CPU value to the passed-in value.
- * @param value CPU's value will be set to this value
-*/
-void set(int value) {
-    cpu.value = value;
-    cout << "Set CPU's value to " << value << endl; 
+    char chunk[64 * 1024];
+    ssize_t numRead;
+    contents.clear();
+    while ((numRead = read(fileDescriptor, chunk, sizeof(chunk))) != 0) {
+        if (numRead == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        contents.append(chunk, numRead);
+    }
+    if (fileDescriptor != STDIN_FILENO) {
+        close(fileDescriptor);
+    }
+    return numRead == 0;
 }
 
 /**
- * Implements the A operation and 
- * Adds the passed-in value to the CPU value.
- * @param value the value which is used to increment CPU's value by this 'value'
-*/
-void add(int value) { 
-    cpu.value += value;
-    cout << "Incremented CPU's value by " << value << endl;
+ * Applies the command-line options to a simulation.
+ */
+void configureSimulation(SimulationContext &context, const SimulatorOptions &options) {
+    context.timeSliceLength = options.timeSlice;
+    context.schedulerPolicy = options.scheduler;
+    context.agingInterval = options.agingInterval;
+    context.randomSeed = options.seed;
+    context.numCpus = options.numCpus;
+    context.numCpuThreads = options.numCpuThreads;
+    context.logLevel = options.logLevel;
+    context.printFormat = options.printFormat;
+    context.checkpointPath = options.checkpointPath;
+    context.checkpointInterval = options.checkpointInterval;
+    context.restorePath = options.restorePath;
 }
 
 /**
- * Implements the D operation and
- * Subtracts the integer value from the CPU value.
- * @param value the value which is used to decrease CPU's value by this 'value'
-*/
-void decrement(int value) {
-    cpu.value -= value;
-    cout << "Decremented CPU's value by " << value << endl; 
+ * Runs the process manager on the commands read from a file descriptor (the pipe from the
+ * commander, or a command script).
+ */
+int runProcessManager(SimulationContext &context, int fileDescriptor) {
+    CommandReader reader(fileDescriptor);
+    return runProcessManager(context, reader);
 }
 
 /**
- * Performs scheduling.
-*/
-void schedule() {
-    // 1. Return if there is still a processing running (runningState != -1). 
-    //    There is no need to schedule if a process is already running (at least until iLab 3)
-    const int fixed_time_slice = 5;
-
-    if (runningState != -1) {
-        cpu.timeSliceUsed += 1;
-        return;
+ * Prints the statistics at the end of a headless run.
+ * @param wallTime the wall time of the run
+ */
+void printRunStatistics(SimulationContext &context, chrono::duration<double> wallTime) {
+    cout << "-------------------------------" << endl;
+    cout << "Run Statistics" << endl;
+    cout << "   Commands: " << context.runStats.numCommands << endl;
+    cout << "   Quanta: " << context.runStats.numQuanta << endl;
+    cout << "   Simulated Time: " << context.timestamp << endl;
+    cout << "   Processes Created: " << context.runStats.numCreatedProcesses << endl;
+    cout << "   Processes Terminated: " << context.numTerminatedProcesses << endl;
+    cout << "   Context Switches: " << context.runStats.numContextSwitches << endl;
+    if (context.numCpus > 1) {
+        cout << "   Work Steals: " << context.runStats.numSteals << endl;
     }
-
-    // 2. Get a new process to run, if possible, from the ready queue.
-    if (!readyState.empty()) {
-        int nextProcess = readyState.front();
-        readyState.pop_front();
-
-        // 3. If we were able to get a new process to run:
-        //     a. Mark the processing as running (update the new process's PCB state)
-        pcbEntry[nextProcess].state = STATE_RUNNING;
-        pcbEntry[nextProcess].timeUsed += 1;
-        //     b. Update the CPU structure with the PCB entry details (program, program counter,
-        //        value, etc.)
-        cpu.pProgram = &pcbEntry[nextProcess].program;
-        cpu.programCounter = pcbEntry[nextProcess].programCounter;
-        cpu.value = pcbEntry[nextProcess].value;   
-        cpu.timeSlice = fixed_time_slice;   
-        cpu.timeSliceUsed = 0;   
-
-        // variable 'runningState' updates to the current process's index
-        runningState = nextProcess; 
-        cout << "Process running, pid = " << pcbEntry[nextProcess].processId << endl; 
+    cout << "   Wall Time (s): " << wallTime.count() << endl;
+    if (wallTime.count() > 0) {
+        cout << "   Quanta per Second: " << context.runStats.numQuanta / wallTime.count() << endl;
     }
 }
 
 /**
- * Implements the B operation.
-*/
-void block() {
-    // TODO: Implement
-    if (runningState != -1) {
-        // 1. Add the PCB index of the running process (stored in runningState) to the blocked queue.
-        blockedState.emplace_back(runningState);
-
-        // 2. Update the process's PCB entry
-        //     a. Change the PCB's state to blocked.
-        pcbEntry[runningState].state = STATE_BLOCKED;
-        //     b. Store the CPU program counter in the PCB's program counter.
-        pcbEntry[runningState].programCounter = cpu.programCounter;
-        //     c. Store the CPU's value in the PCB's value.
-        pcbEntry[runningState].value = cpu.value;
-
-        // 3. Update the running state to -1 (basically mark no process as running). 
-        //    Note that a new process will be chosen to run later (via the Q command code calling the schedule() function).
-        runningState = -1;
-        cout << "Blocked process, pid = " << pcbEntry[runningState].processId << endl; 
+ * Runs a command script straight into the process manager, without the commander
+ * process and the pipe, then prints the end-of-run statistics.
+ * @param scriptPath the command script to replay, "-" for stdin
+ */
+int runHeadless(SimulationContext &context, const string &scriptPath) {
+    int fileDescriptor = STDIN_FILENO;
+    if (scriptPath != "-") {
+        fileDescriptor = open(scriptPath.c_str(), O_RDONLY);
+        if (fileDescriptor == -1) {
+            cout << "Error opening command script " << scriptPath << ": " << strerror(errno) << endl;
+            return EXIT_FAILURE;
+        }
     }
-}
-
-// Implements the E operation.
-void end() {
-    // TODO: Implement
-    if (runningState != -1) {
-        // 1. Get the PCB entry of the running process.
-        PcbEntry& running_pro = pcbEntry[runningState];
 
-        // 2. Update the cumulative time difference (increment it by timestamp + 1 - start time of the process).
-        cumulativeTimeDiff = cumulativeTimeDiff + (timestamp + 1 - running_pro.startTime);
+    chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+    int result = runProcessManager(context, fileDescriptor);
+    chrono::duration<double> wallTime = chrono::steady_clock::now() - startTime;
 
-        // 3. Increment the number of terminated processes.
-        numTerminatedProcesses++;
+    if (fileDescriptor != STDIN_FILENO) {
+        close(fileDescriptor);
+    }
 
-        cout << "Ended process, pid = " << running_pro.processId << endl; 
-        // 4. Update the running state to -1 (basically mark no process as running). 
-        //    Note that a new process will be chosen to run later (via the Q command code calling the schedule function).
-        runningState = -1;
-    } 
+    printRunStatistics(context, wallTime);
+    return result;
 }
 
 /**
- * Implements the F operation.
- * @param value
-*/
-void fork(int value) {
-    // TODO: Implement
-    // 1. Get a free PCB index (pcbTable.size())
-    int free_PCB_index = -1;
-    for (int i = 0; i < NUM_OF_PROCESSES; i++) {
-        if (pcbEntry[i].processId == -1) {
-            free_PCB_index = i;
-            break;
-        }
+ * Replays a trace file, verifying that the simulation produces the same events again.
+ * @param tracePath the trace recorded with --record
+ * @param stopTime the simulated time to stop at, or -1 to replay the whole trace
+ */
+int runReplay(SimulationContext &context, const string &tracePath, long long stopTime) {
+    TraceReplayer replayer(context);
+    if (!replayer.open(tracePath)) {
+        return EXIT_FAILURE;
     }
-
-    // 2. Get the PCB entry for the current running process.
-    PcbEntry& parent_pro = pcbEntry[runningState];
-
-    // 3. Ensure the passed-in value is not out of bounds.
-    // 4. Populate the PCB entry obtained in #1
-    //     a. Set the process ID to the PCB index obtained in #1.
-    //     b. Set the parent process ID to the process ID of the running process 
-    //        (use the running process's PCB entry to get this).
-    //     c. Set the program counter to the cpu program counter.
-    //     d. Set the value to the cpu value.
-    //     e. Set the priority to the same as the parent process's priority.
-    //     f. Set the state to the ready state.
-    //     g. Set the start time to the current timestamp
-    if((free_PCB_index != -1) && ((value >= 0) && (value < parent_pro.program.size())) ){
-	    PcbEntry& child_pro = pcbEntry[free_PCB_index];
-        child_pro.processId = free_PCB_index;
-        child_pro.parentProcessId = parent_pro.processId;
-        child_pro.programCounter = cpu.programCounter;
-        child_pro.value = cpu.value;
-        child_pro.priority = parent_pro.priority;
-        child_pro.state = STATE_READY;
-        child_pro.startTime = timestamp;
-        cout << "Forked new process, pid = " << child_pro.processId << endl; 
+    if (stopTime >= 0) {
+        // Fast-forward silently; only the state at the stop time is printed (in the format
+        // and to the target of --print-format and --print-output).
+        replayer.stopAt(stopTime);
+        context.logLevel = LOG_OFF;
     }
 
-    // 5. Add the pcb index to the ready queue
-    readyState.push_back(free_PCB_index);
+    context.traceObserver = &replayer;
+    chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+    runProcessManager(context, replayer);
+    chrono::duration<double> wallTime = chrono::steady_clock::now() - startTime;
+    context.traceObserver = NULL;
 
-    // 6. Increment the cpu's program counter by the value read in #3
-    cpu.programCounter += value;
+    printRunStatistics(context, wallTime);
+    if (!replayer.getDivergence().empty()) {
+        cout << "Replay failed: " << replayer.getDivergence() << endl;
+        return EXIT_FAILURE;
+    }
+    cout << "Replay matched the trace: " << replayer.getNumCommands() << " commands, "
+         << replayer.getNumEvents() << " events" << endl;
+    return EXIT_SUCCESS;
 }
 
+// The outcome of one simulation of a sweep.
+class SimulationResult {
+public:
+    int exitCode;
+    unsigned int simulatedTime;
+    int numTerminatedProcesses;
+    double averageTurnaroundTime;
+    double averageWaitingTime;
+    RunStatistics stats;
+};
+
 /**
- * Implements the R operation.
- * @param argument the address of the string variable 'argument'
- */ 
-void replace(string &argument) {
-    // TODO: Implement
-    // 1. Clear the CPU's program (cpu.pProgram->clear())
-    cpu.pProgram->clear();
-
-    // 2. Use createProgram() to read in the filename specified by argument into the CPU (*cpu.pProgram)
-    bool successful_create_program = createProgram(argument, *cpu.pProgram);
-    // a. Consider what to do if createProgram fails. [I printed an error, 
-    //    incremented the cpu program counter and then returned.] 
-    //    Note that createProgram can fail if the file could not be opened or did not exist.
-    if (!successful_create_program)
-    {
-        cout << "Error occurred when executing R operation, end the process now!" << endl;
-        cpu.programCounter++;
-        return;
-    }
+ * Runs independent simulations of one command script on a pool of host threads. Every
+ * simulation has its own context and prints nothing; the simulations only share the program
+ * cache and the string table, so each program is parsed once for the whole sweep.
+ * @param configurations the options of every simulation
+ * @param script the command script, shared by all simulations
+ * @param numThreads the number of host threads
+ * @return the results, in the order of the configurations
+ */
+vector<SimulationResult> runSimulations(const vector<SimulatorOptions> &configurations,
+                                        const string &script, unsigned int numThreads) {
+    vector<SimulationResult> results(configurations.size());
+    atomic<size_t> nextSimulation(0);
 
-    // 3. Set the program counter to 0.
-    cpu.programCounter = 0;
-    cout << "Replaced process with " << argument << ", pid = " << pcbEntry[runningState].processId << endl;
-}
+    auto runWorker = [&]() {
+        ostream discardedOutput(NULL);
+        size_t index;
+        while ((index = nextSimulation.fetch_add(1)) < configurations.size()) {
+            SimulationContext context;
+            configureSimulation(context, configurations[index]);
+            context.logLevel = LOG_OFF;
+            context.output = &discardedOutput;
+            context.checkpointPath.clear();
+            context.reuseCachedPrograms = true;
 
-// Implements the Q command.
-void quantum() {
-    Instruction instruction;
-    cout << "In quantum ";
-    if (runningState == -1) {
-        cout << "No processes are running" << endl;
-        ++timestamp;
-        return;
-    }
+            MemoryCommandReader reader(script);
+            SimulationResult &result = results[index];
+            result.exitCode = runProcessManager(context, reader);
+            result.simulatedTime = context.timestamp;
+            result.numTerminatedProcesses = context.numTerminatedProcesses;
+            result.averageTurnaroundTime = context.numTerminatedProcesses > 0
+                ? context.cumulativeTimeDiff / context.numTerminatedProcesses : 0;
+            result.averageWaitingTime = context.numTerminatedProcesses > 0
+                ? context.metrics.totalWaitingTime / context.numTerminatedProcesses : 0;
+            result.stats = context.runStats;
+        }
+    };
 
-    if (cpu.programCounter < cpu.pProgram->size()) {
-        instruction = (*cpu.pProgram)[cpu.programCounter];
-        ++cpu.programCounter;
-    } 
-    else {
-        cout << "End of program reached without E operation" << endl;
-        instruction.operation = 'E';
+    vector<thread> workers;
+    for (unsigned int t = 1; t < numThreads; ++t) {
+        workers.emplace_back(runWorker);
     }
-    
-    switch (instruction.operation) {
-        case 'S':
-            set(instruction.intArg);
-            cout << "instruction S " << instruction.intArg << endl;
-            break;
-        case 'A':
-            add(instruction.intArg);
-            cout << "instruction A " << instruction.intArg << endl;
-            break;
-        case 'D':
-            decrement(instruction.intArg);
-            break;
-        case 'B':
-            block();
-            break;
-        case 'E':
-            end();
-            break;
-        case 'F':
-            fork(instruction.intArg);
-            break;
-        case 'R':
-            replace(instruction.stringArg);
-            break;
+    runWorker();
+    for (thread &worker: workers) {
+        worker.join();
     }
-
-    timestamp++;
-    schedule();
+    return results;
 }
 
 /**
- * Implements the U command.
-*/
-void unblock() {
-    // If the blocked queue contains any processes:
-    if (!blockedState.empty()) {
-        //  a. Remove a process form the front of the blocked queue.
-        int next_process = blockedState.front();
-        blockedState.pop_front();
-        //  b. Add the process to the ready queue.
-        readyState.emplace_back(next_process);
-        //  c. Change the state of the process to ready (update its PCB entry).
-        pcbEntry[next_process].state = STATE_READY;
-        //  d. Call the schedule() function to give an unblocked process a chance to run (if possible).
-        schedule();
-        cout << "Unblocked process, pid = " << pcbEntry[next_process].processId << endl; 
+ * Runs a sweep of simulations of one command script in a single process: every combination of
+ * the swept policies, time slices and CPU counts. Lottery combinations run with --sweep seeds
+ * starting at --seed, the others once. Prints a table with one row per combination, averaged
+ * over its runs.
+ * @param options the options shared by the simulations
+ */
+int runSweep(const SimulatorOptions &options) {
+    string scriptPath = options.scriptPath.empty() ? "-" : options.scriptPath;
+    string script;
+    if (!readFile(scriptPath, script)) {
+        cout << "Error reading command script " << scriptPath << ": " << strerror(errno) << endl;
+        return EXIT_FAILURE;
     }
-}
 
-/**
- * Implements the helper function of print function below to execute P cmd.
- * @param state_name the passed name of state of the process which needs to be converted to string
-*/
-string helper_converting_state(State state_name) {
-    if (state_name == STATE_READY) {
-        return "READY";
+    // 1. Build the configurations, combination by combination. Options that are not swept
+    //    keep their single value, and the CPUs of a simulation all run on its host thread.
+    vector<SchedulerPolicy> policies = options.sweepPolicies;
+    if (policies.empty()) {
+        policies.push_back(options.scheduler);
     }
-    else if (state_name == STATE_RUNNING) {
-        return "RUNNING";
+    vector<unsigned int> timeSlices = options.sweepTimeSlices;
+    if (timeSlices.empty()) {
+        timeSlices.push_back(options.timeSlice);
     }
-    else if (state_name == STATE_BLOCKED) {
-        return "BLOCKED";
+    vector<unsigned int> cpuCounts = options.sweepCpuCounts;
+    if (cpuCounts.empty()) {
+        cpuCounts.push_back(options.numCpus);
     }
-    else {
-        return "UNIDENTIFIED!";
+    unsigned int numSeeds = max(1u, options.sweepCount);
+
+    // Only the lottery policy uses the seed; the others run once per combination, as every
+    // seed would give the same result.
+    vector<SimulatorOptions> configurations;
+    vector<size_t> rowStarts;
+    for (SchedulerPolicy policy: policies) {
+        unsigned int numRuns = policy == POLICY_LOTTERY ? numSeeds : 1;
+        for (unsigned int timeSlice: timeSlices) {
+            for (unsigned int numCpus: cpuCounts) {
+                rowStarts.push_back(configurations.size());
+                for (unsigned int i = 0; i < numRuns; ++i) {
+                    SimulatorOptions configuration = options;
+                    configuration.scheduler = policy;
+                    configuration.timeSlice = timeSlice;
+                    configuration.numCpus = numCpus;
+                    configuration.numCpuThreads = 1;
+                    configuration.seed = options.seed + i;
+                    configurations.push_back(configuration);
+                }
+            }
+        }
     }
-}
+    rowStarts.push_back(configurations.size());
 
-/**
- * Implements the P command.
-*/
-void print() {
-    //cout << "Print command is not implemented until iLab 3" << endl;
-    cout << "" <<endl;
-    cout << "***************************************************" << endl;
-    cout << "The Current System State: \n";
+    // 2. Run them all.
+    chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+    vector<SimulationResult> results = runSimulations(configurations, script, options.sweepThreads);
+    chrono::duration<double> wallTime = chrono::steady_clock::now() - startTime;
 
-    cout << "CURRENT TIME: " << timestamp << endl;
+    // 3. Print one row per combination. Throughput is the number of processes terminated per
+    //    unit of simulated time.
+    int exitCode = EXIT_SUCCESS;
+    ios::fmtflags flags = cout.flags();
+    streamsize precision = cout.precision(2);
+    cout << fixed;
+    cout << left << setw(10) << "Policy" << right << setw(7) << "Slice" << setw(6) << "CPUs"
+         << setw(6) << "Runs" << setw(12) << "Turnaround" << setw(10) << "Waiting"
+         << setw(12) << "Throughput" << setw(10) << "Switches" << endl;
+    for (size_t row = 0; row + 1 < rowStarts.size(); ++row) {
+        size_t first = rowStarts[row];
+        size_t numRuns = rowStarts[row + 1] - first;
+        const SimulatorOptions &configuration = configurations[first];
+        cout << left << setw(10) << schedulerNames[configuration.scheduler] << right
+             << setw(7) << configuration.timeSlice << setw(6) << configuration.numCpus
+             << setw(6) << numRuns;
 
-    if (runningState != -1) {
-        cout << "Current Running State(s): " << to_string(runningState) << endl;
-    } 
-    else {
-        cout << "No State Running!" << endl;
+        double turnaroundTime = 0, waitingTime = 0, throughput = 0, numContextSwitches = 0;
+        bool failed = false;
+        for (size_t i = first; i < first + numRuns; ++i) {
+            const SimulationResult &result = results[i];
+            failed = failed || result.exitCode != EXIT_SUCCESS;
+            turnaroundTime += result.averageTurnaroundTime;
+            waitingTime += result.averageWaitingTime;
+            throughput += result.simulatedTime > 0
+                ? (double) result.numTerminatedProcesses / result.simulatedTime : 0;
+            numContextSwitches += result.stats.numContextSwitches;
+        }
+        if (failed) {
+            cout << "  failed to start" << endl;
+            exitCode = EXIT_FAILURE;
+            continue;
+        }
+        cout << setw(12) << turnaroundTime / numRuns << setw(10) << waitingTime / numRuns
+             << setw(12) << throughput / numRuns << setw(10) << numContextSwitches / numRuns
+             << endl;
     }
+    cout.flags(flags);
+    cout.precision(precision);
 
     cout << "-------------------------------" << endl;
+    cout << "Simulations: " << results.size() << " (" << numSeeds
+         << " seeds per lottery row, one run per other row) on " << options.sweepThreads
+         << " threads" << endl;
+    cout << "Wall Time (s): " << wallTime.count() << endl;
+    if (wallTime.count() > 0) {
+        cout << "Simulations per Second: " << results.size() / wallTime.count() << endl;
+    }
+    return exitCode;
+}
 
-    cout << "Process(es) in Ready Queue" << endl;
-    for (int process: readyState){
-        cout << process << endl;
+/**
+ * Feeds the commands of a script into the MPSC queue as one producer. The producer closes at
+ * the first 'T' or at the end of the script.
+ * @param queue the queue to feed
+ * @param producer the index of the producer
+ * @param fileDescriptor the command script
+ */
+void runCommandProducer(MpscCommandQueue *queue, unsigned int producer, int fileDescriptor) {
+    CommandReader reader(fileDescriptor);
+    char command;
+    unsigned int count;
+    while (reader.next(command, count) && command != 'T') {
+        queue->push(producer, command, count);
     }
+    queue->close(producer);
+}
 
-    cout << "-------------------------------" << endl;
+/**
+ * Runs the process manager headless on several command scripts at once, each pushed into an
+ * MPSC queue by its own producer thread, then prints the end-of-run statistics.
+ * @param scriptPaths the command scripts, one per producer
+ */
+int runProducers(SimulationContext &context, const vector<string> &scriptPaths) {
+    vector<int> fileDescriptors;
+    for (const string &scriptPath: scriptPaths) {
+        int fileDescriptor = open(scriptPath.c_str(), O_RDONLY);
+        if (fileDescriptor == -1) {
+            cout << "Error opening command script " << scriptPath << ": " << strerror(errno) << endl;
+            for (int opened: fileDescriptors) {
+                close(opened);
+            }
+            return EXIT_FAILURE;
+        }
+        fileDescriptors.push_back(fileDescriptor);
+    }
 
-    cout << "Process(es) in Blocked Queue" << endl;
-    for (int process: blockedState) {
-        cout << process << endl;
+    MpscCommandQueue queue(scriptPaths.size(), 4096);
+    chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+    vector<thread> producerThreads;
+    for (size_t i = 0; i < fileDescriptors.size(); ++i) {
+        producerThreads.emplace_back(runCommandProducer, &queue, i, fileDescriptors[i]);
     }
 
-    cout << "-------------------------------" << endl;
-    cout << "Process Table" << endl;
-    cout << "" <<endl;
+    int result = runProcessManager(context, queue);
+    chrono::duration<double> wallTime = chrono::steady_clock::now() - startTime;
 
-    for (const auto& each_process: pcbEntry) {
-        if (each_process.processId >= 0) {
-            cout << "   PID: " << each_process.processId << endl;
-            cout << "   Parent PID: " << each_process.parentProcessId << endl;
-            cout << "   Process Program Counter: " << each_process.programCounter << endl;
-            cout << "   Process Value: " << each_process.value << endl;
-            cout << "   Process Priority: " << each_process.priority << endl;
-            cout << "   Process State: " << helper_converting_state(each_process.state) << endl;
-            
-            cout << "   Process Start: " << each_process.startTime << endl;
-            cout << "   Process timeUsed: " << each_process.timeUsed << endl;
-            cout << "........................" << endl;
-        }
+    for (size_t i = 0; i < producerThreads.size(); ++i) {
+        producerThreads[i].join();
+        close(fileDescriptors[i]);
     }
 
-    cout << "***************************************************" << endl;
+    printRunStatistics(context, wallTime);
+    return result;
 }
 
-// Function that implements the process manager.
-int runProcessManager(int fileDescriptor) {
-    //vector<PcbEntry> pcbTable;
-    // Attempt to create the init process.
-    if (!createProgram("file.txt", pcbEntry[0].program)) {
+// benchmarks.cpp compiles the simulator in with SIMULATOR_NO_MAIN defined, to call its
+// functions directly.
+#ifndef SIMULATOR_NO_MAIN
+int main(int argc, char *argv[]) {
+    ios::sync_with_stdio(false);
+
+    SimulatorOptions options;
+    if (!parseOptions(argc, argv, options)) {
         return EXIT_FAILURE;
     }
+    SimulationContext context;
+    configureSimulation(context, options);
 
-    pcbEntry[0].processId = 0;
-    pcbEntry[0].parentProcessId = -1;
-    pcbEntry[0].programCounter = 0;
-    pcbEntry[0].value = 0;
-    pcbEntry[0].priority = 0;
-    pcbEntry[0].state = STATE_RUNNING;
-    pcbEntry[0].startTime = 0;
-    pcbEntry[0].timeUsed = 0;
-
-    for (int i = 1; i < 10; ++i) {
-        pcbEntry[i].processId = -1;
-        pcbEntry[i].parentProcessId = -1;
-        pcbEntry[i].programCounter = 0;
-        pcbEntry[i].value = 0;
-        pcbEntry[i].priority = 0;
-        pcbEntry[i].state = STATE_READY;
-        pcbEntry[i].startTime = 0;
-        pcbEntry[i].timeUsed = 0;
+    if (options.replayPath.empty()
+        && (options.sweepCount > 0 || !options.sweepPolicies.empty()
+            || !options.sweepTimeSlices.empty() || !options.sweepCpuCounts.empty())) {
+        return runSweep(options);
     }
 
-    runningState = 0;
-
-    cpu.pProgram = &(pcbEntry[0].program);
-    cpu.programCounter = pcbEntry[0].programCounter;
-    cpu.value = pcbEntry[0].value;
-    timestamp = 0;
-    double avgTurnaroundTime = 0;
-
-    // Loop until a 'T' is read, then terminate.
-    char ch;
-    do {
-        // Read a command character from the pipe.
-        if (read(fileDescriptor, &ch, sizeof(ch)) != sizeof(ch)) {
-            // Assume the parent process exited, breaking the pipe.
-            break;
+    // The trace is written by whichever process runs the process manager.
+    TraceWriter traceWriter;
+    if (!options.recordPath.empty() && options.replayPath.empty()) {
+        if (!traceWriter.open(context, options.recordPath)) {
+            cout << "Error creating trace " << options.recordPath << ": " << strerror(errno) << endl;
+            return EXIT_FAILURE;
         }
+        context.traceObserver = &traceWriter;
+    }
 
-        //TODO: Write a switch statement
-        switch (ch) {
-            case 'Q':
-                quantum();
-                break;
-            case 'U':
-                cout << "You entered U" << endl;
-                unblock();
-                break;
-            case 'P':
-                cout << "You entered P" << endl;
-                print();
-                break;
-            case 'T':
-                cout << "Terminate!" << endl;
-                break;
-            default:
-                cout << "You entered an invalid character!" << endl;
+    // So is the output of the P command, if it does not simply go with the other replies.
+    StateWriter stateWriter;
+    if (options.printFormat != PRINT_TEXT || !options.printOutput.empty()) {
+        string target = options.printOutput.empty() ? "-" : options.printOutput;
+        if (!stateWriter.open(target)) {
+            cout << "Error opening " << target << " for the P command: " << strerror(errno) << endl;
+            return EXIT_FAILURE;
         }
-    } while (ch != 'T');
-
-    if (numTerminatedProcesses > 0) {
-		double avg_turn_ard_time = (cumulativeTimeDiff)/(numTerminatedProcesses);
-		cout << "Average Turnaround Time: " << avg_turn_ard_time << endl;
-	}
-	else {
-		cout << "Terminated with nothing!" << endl;
-	}
+        context.stateWriter = &stateWriter;
+    }
 
-    return EXIT_SUCCESS;
-}
+    if (!options.replayPath.empty()) {
+        return runReplay(context, options.replayPath, options.replayUntil);
+    }
+    if (!options.producerScripts.empty()) {
+        return runProducers(context, options.producerScripts);
+    }
+    if (!options.scriptPath.empty()) {
+        return runHeadless(context, options.scriptPath);
+    }
 
-int main(int argc, char *argv[]) {
     int pipeDescriptors[2];
     pid_t processMgrPid;
-    char ch;
+    string line;
     int result;
+    ShmCommandRing *ring = NULL;
 
     //TODO: Create a pipe
-    if (pipe(pipeDescriptors) == -1) {
+    if (options.useSharedMemory) {
+        // The shared-memory ring replaces the pipe.
+        ring = ShmCommandRing::create();
+        if (ring == NULL) {
+            cout << "Error creating the shared-memory ring: " << strerror(errno) << endl;
+            return 1;
+        }
+    }
+    else if (pipe(pipeDescriptors) == -1) {
 	    return 1;
     }
 
@@ -579,11 +4984,18 @@ int main(int argc, char *argv[]) {
     if((processMgrPid = fork()) == -1) exit(1); /* FORK FAILED */
     if (processMgrPid == 0) {
         // The process manager process is running.
+        if (ring != NULL) {
+            ShmCommandReader reader(ring);
+            result = runProcessManager(context, reader);
+            ring->closeReader();
+            _exit(result);
+        }
+
         // Close the unused write end of the pipe for the process manager process.
         close(pipeDescriptors[1]);
         
         // Run the process manager.
-        result = runProcessManager(pipeDescriptors[0]);
+        result = runProcessManager(context, pipeDescriptors[0]);
 
         // Close the read end of the pipe for the process manager process (for cleanup purposes).
         close(pipeDescriptors[0]);
@@ -593,25 +5005,36 @@ int main(int argc, char *argv[]) {
     else {
         // The commander process is running.
         // Close the unused read end of the pipe for the commander process.
-        close(pipeDescriptors[0]);
+        if (ring == NULL) {
+            close(pipeDescriptors[0]);
+        }
 
         // Loop until a 'T' is written or until the pipe is broken.
         do {
-            cout << "Enter Q, P, U or T" << endl;
+            cout << "Enter Q, P, U or T (a count such as Q100 repeats the command)" << endl;
             cout << "$ ";
-            cin >> ch ;
+            if (!getline(cin, line)) {
+                // Terminate the process manager when the input runs out.
+                line = "T";
+            }
+            line += '\n';
 
-            // Pass commands to the process manager process via the pipe.
-            if (write(pipeDescriptors[1], &ch, sizeof(ch)) != sizeof(ch)) {
+            // Pass the whole line of commands to the process manager process in one write.
+            bool written = ring != NULL ? ring->write(line.data(), line.size())
+                                        : writeAll(pipeDescriptors[1], line.data(), line.size());
+            if (!written) {
                 // Assume the child process exited, breaking the pipe.
                 break;
             }
-        } while (ch != 'T');
-
-        write(pipeDescriptors[1], &ch, sizeof(ch));
+        } while (line.find('T') == string::npos);
 
         // Close the write end of the pipe for the commander process (for cleanup purposes).
-        close(pipeDescriptors[1]);
+        if (ring != NULL) {
+            ring->closeWriter();
+        }
+        else {
+            close(pipeDescriptors[1]);
+        }
 
         // Wait for the process manager to exit.
         wait(&result);
@@ -619,3 +5042,4 @@ int main(int argc, char *argv[]) {
     
     return result;
 }
+#endif
@@ -0,0 +1,334 @@
+#include <cerrno> // for errno
+#include <cstdlib> // for EXIT_SUCCESS and EXIT_FAILURE
+#include <cstring> // for strerror()
+#include <fstream> // for ofstream (used for writing program files)
+#include <iostream> // for cout and cerr
+#include <random> // for mt19937 and the distributions
+#include <string>
+#include <sys/stat.h> // for mkdir()
+#include <vector>
+
+using namespace std;
+
+// Synthetic workloads for the simulator, in two parts:
+//
+// - "programs" writes a family of program files to a directory. file.txt is the init process,
+//   the root of a fork tree: every program of a level forks children that replace themselves
+//   (R) with a random program of the next level. A program may also end by replacing itself
+//   with the next program of its replace chain instead of ending (E). Between these, programs
+//   run CPU bursts of S/A/D instructions and sometimes block (B). The files stay small while
+//   the fork tree can grow to millions of processes at run time.
+// - "commands" streams a command script to stdout (Q with a number of quanta, U, P, ended by
+//   T), so arbitrarily long runs never exist on disk:
+//
+//     workload_generator programs --directory w --levels 5 --fanout poisson:15
+//     cd w && workload_generator commands --commands 100000 | final_code --script -
+
+/**
+ * A distribution of non-negative counts, parsed from "fixed:N" (or just "N"), "uniform:A-B",
+ * "geometric:MEAN" or "poisson:MEAN".
+ */
+class CountDistribution {
+public:
+    enum Kind {
+        FIXED,
+        UNIFORM,
+        GEOMETRIC,
+        POISSON
+    };
+
+    CountDistribution(Kind kind = FIXED, double first = 0, double second = 0)
+        : kind(kind), first(first), second(second) {}
+
+    /**
+     * Parses a distribution.
+     * @param text the specification
+     * @param distribution set to the distribution if the specification is valid
+     * @return false if the specification is invalid
+     */
+    static bool parse(const string &text, CountDistribution &distribution) {
+        size_t colon = text.find(':');
+        string name = colon == string::npos ? "fixed" : text.substr(0, colon);
+        string arguments = colon == string::npos ? text : text.substr(colon + 1);
+        char *end;
+        double first = strtod(arguments.c_str(), &end);
+        if (end == arguments.c_str() || first < 0) {
+            return false;
+        }
+
+        if (name == "uniform") {
+            if (*end != '-') {
+                return false;
+            }
+            const char *secondText = end + 1;
+            double second = strtod(secondText, &end);
+            if (end == secondText || *end != '\0' || second < first) {
+                return false;
+            }
+            distribution = CountDistribution(UNIFORM, first, second);
+            return true;
+        }
+        if (*end != '\0') {
+            return false;
+        }
+        if (name == "fixed") {
+            distribution = CountDistribution(FIXED, first);
+        }
+        else if (name == "geometric") {
+            distribution = CountDistribution(GEOMETRIC, first);
+        }
+        else if (name == "poisson") {
+            distribution = CountDistribution(POISSON, first);
+        }
+        else {
+            return false;
+        }
+        return true;
+    }
+
+    unsigned long sample(mt19937 &random) const {
+        switch (kind) {
+            case UNIFORM:
+                return uniform_int_distribution<unsigned long>(first, second)(random);
+            case GEOMETRIC:
+                return geometric_distribution<unsigned long>(1 / (first + 1))(random);
+            case POISSON:
+                return first > 0 ? poisson_distribution<unsigned long>(first)(random) : 0;
+            default:
+                return first;
+        }
+    }
+
+private:
+    Kind kind;
+    double first;
+    double second;
+};
+
+// Options of the generator.
+class GeneratorOptions {
+public:
+    unsigned int seed = 1;
+
+    // Options of the programs.
+    string directory = "workload";
+    // Depth of the fork tree below the init process, and programs per level.
+    unsigned int numLevels = 3;
+    unsigned int numVariants = 4;
+    CountDistribution fanout = CountDistribution(CountDistribution::FIXED, 4);
+    CountDistribution burstLength = CountDistribution(CountDistribution::GEOMETRIC, 5);
+    // Probability that a CPU burst is followed by a B.
+    double blockProbability = 0.1;
+    CountDistribution replaceChainLength = CountDistribution(CountDistribution::FIXED, 0);
+
+    // Options of the command script.
+    unsigned long long numCommands = 1000;
+    CountDistribution quanta = CountDistribution(CountDistribution::FIXED, 100);
+    // Probability that a Q is followed by a U.
+    double unblockProbability = 0.5;
+    // A P every that many commands, 0 for none.
+    unsigned long long printInterval = 0;
+};
+
+/**
+ * Gets the file name of a generated program.
+ * @param level the level of the fork tree, 0 for the init process
+ * @param variant the variant of the level
+ * @param step the position in the replace chain
+ */
+string programName(unsigned int level, unsigned int variant, unsigned long step) {
+    if (level == 0 && step == 0) {
+        return "file.txt";
+    }
+    return "gen_" + to_string(level) + "_" + to_string(variant) + "_" + to_string(step);
+}
+
+/**
+ * Writes a CPU burst, followed by a B with the block probability.
+ */
+void writeBurst(ofstream &file, const GeneratorOptions &options, mt19937 &random) {
+    static const char operations[] = {'S', 'A', 'D'};
+    unsigned long length = options.burstLength.sample(random);
+    uniform_int_distribution<int> operation(0, 2);
+    uniform_int_distribution<int> argument(1, 1000);
+    for (unsigned long i = 0; i < length; ++i) {
+        file << operations[operation(random)] << ' ' << argument(random) << '\n';
+    }
+    if (bernoulli_distribution(options.blockProbability)(random)) {
+        file << "B\n";
+    }
+}
+
+/**
+ * Writes the program files.
+ * @return false if a file cannot be written
+ */
+bool generatePrograms(const GeneratorOptions &options, mt19937 &random) {
+    if (mkdir(options.directory.c_str(), 0755) == -1 && errno != EEXIST) {
+        cerr << "Error creating " << options.directory << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    // The expected number of processes a program of each level accounts for (itself and its
+    // descendants), computed from the leaves up.
+    double expectedProcesses = 1;
+    unsigned long numFiles = 0;
+    for (int level = options.numLevels; level >= 0; --level) {
+        unsigned int numVariants = level == 0 ? 1 : options.numVariants;
+        double levelProcesses = 0;
+        for (unsigned int variant = 0; variant < numVariants; ++variant) {
+            // 1. The first program of the chain forks the children (none on the last level).
+            unsigned long numChildren = (unsigned int) level < options.numLevels
+                ? options.fanout.sample(random) : 0;
+            unsigned long chainLength = options.replaceChainLength.sample(random);
+            levelProcesses += 1 + numChildren * expectedProcesses;
+
+            for (unsigned long step = 0; step <= chainLength; ++step) {
+                string path = options.directory + "/" + programName(level, variant, step);
+                ofstream file(path.c_str());
+                writeBurst(file, options, random);
+                uniform_int_distribution<unsigned int> childVariant(0, options.numVariants - 1);
+                for (unsigned long child = 0; step == 0 && child < numChildren; ++child) {
+                    file << "F 1\n" << "R " << programName(level + 1, childVariant(random), 0) << '\n';
+                    writeBurst(file, options, random);
+                }
+
+                // 2. Then it moves on along the chain, or ends.
+                if (step < chainLength) {
+                    file << "R " << programName(level, variant, step + 1) << '\n';
+                }
+                else {
+                    file << "E\n";
+                }
+
+                file.close();
+                if (!file) {
+                    cerr << "Error writing " << path << endl;
+                    return false;
+                }
+                ++numFiles;
+            }
+        }
+        expectedProcesses = levelProcesses / numVariants;
+    }
+
+    cerr << "Wrote " << numFiles << " programs to " << options.directory
+         << ", expected processes: " << (unsigned long long) expectedProcesses << endl;
+    return true;
+}
+
+/**
+ * Streams the command script to stdout.
+ */
+void generateCommands(const GeneratorOptions &options, mt19937 &random) {
+    bernoulli_distribution unblock(options.unblockProbability);
+    for (unsigned long long i = 1; i <= options.numCommands; ++i) {
+        cout << 'Q' << max(1ul, options.quanta.sample(random)) << '\n';
+        if (unblock(random)) {
+            cout << "U\n";
+        }
+        if (options.printInterval > 0 && i % options.printInterval == 0) {
+            cout << "P\n";
+        }
+    }
+    cout << "T\n";
+    cout.flush();
+}
+
+/**
+ * Parses a probability between 0 and 1.
+ * @return false if the text is not one
+ */
+bool parseProbability(const char *text, double &probability) {
+    char *end;
+    probability = strtod(text, &end);
+    return end != text && *end == '\0' && probability >= 0 && probability <= 1;
+}
+
+/**
+ * Parses the command-line options.
+ * @param options the options to fill in
+ * @return false (after printing the usage) if the arguments are invalid
+ */
+bool parseOptions(int argc, char *argv[], bool &programs, GeneratorOptions &options) {
+    if (argc < 2 || (string(argv[1]) != "programs" && string(argv[1]) != "commands")) {
+        argc = 0;
+    }
+    programs = argc > 0 && string(argv[1]) == "programs";
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--seed" && i + 1 < argc) {
+            options.seed = strtoul(argv[++i], NULL, 10);
+        }
+        else if (programs && arg == "--directory" && i + 1 < argc) {
+            options.directory = argv[++i];
+        }
+        else if (programs && arg == "--levels" && i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+            options.numLevels = atoi(argv[++i]);
+        }
+        else if (programs && arg == "--variants" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            options.numVariants = atoi(argv[++i]);
+        }
+        else if (programs && arg == "--fanout" && i + 1 < argc
+                 && CountDistribution::parse(argv[i + 1], options.fanout)) {
+            ++i;
+        }
+        else if (programs && arg == "--burst" && i + 1 < argc
+                 && CountDistribution::parse(argv[i + 1], options.burstLength)) {
+            ++i;
+        }
+        else if (programs && arg == "--block-probability" && i + 1 < argc
+                 && parseProbability(argv[i + 1], options.blockProbability)) {
+            ++i;
+        }
+        else if (programs && arg == "--replace-chain" && i + 1 < argc
+                 && CountDistribution::parse(argv[i + 1], options.replaceChainLength)) {
+            ++i;
+        }
+        else if (!programs && arg == "--commands" && i + 1 < argc) {
+            options.numCommands = strtoull(argv[++i], NULL, 10);
+        }
+        else if (!programs && arg == "--quanta" && i + 1 < argc
+                 && CountDistribution::parse(argv[i + 1], options.quanta)) {
+            ++i;
+        }
+        else if (!programs && arg == "--unblock-probability" && i + 1 < argc
+                 && parseProbability(argv[i + 1], options.unblockProbability)) {
+            ++i;
+        }
+        else if (!programs && arg == "--print-interval" && i + 1 < argc) {
+            options.printInterval = strtoull(argv[++i], NULL, 10);
+        }
+        else {
+            argc = 0;
+        }
+    }
+
+    if (argc == 0) {
+        cerr << "Usage: " << argv[0] << " programs [--directory <dir>] [--levels <depth>]"
+             << " [--variants <count>] [--fanout <distribution>] [--burst <distribution>]"
+             << " [--block-probability <p>] [--replace-chain <distribution>] [--seed <seed>]" << endl;
+        cerr << "       " << argv[0] << " commands [--commands <count>] [--quanta <distribution>]"
+             << " [--unblock-probability <p>] [--print-interval <commands>] [--seed <seed>]" << endl;
+        cerr << "Distributions: fixed:N (or N), uniform:A-B, geometric:MEAN, poisson:MEAN" << endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    ios::sync_with_stdio(false);
+
+    bool programs;
+    GeneratorOptions options;
+    if (!parseOptions(argc, argv, programs, options)) {
+        return EXIT_FAILURE;
+    }
+
+    mt19937 random(options.seed);
+    if (programs) {
+        return generatePrograms(options, random) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    generateCommands(options, random);
+    return EXIT_SUCCESS;
+}